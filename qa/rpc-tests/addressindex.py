@@ -0,0 +1,127 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test -addressindex and -spentindex across a reorg and a -reindex
+#
+
+from test_framework import BitcoinTestFramework
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+INDEX_ARGS = ["-debug", "-addressindex", "-spentindex"]
+# A key no coinbase pays to, so the address only sees the outputs of this test
+PRIVKEY = "cQfvq4RqbgAidkGELNq6qWWs9JrPArKDhroTA5xxd7pTgKHxUZKX"
+
+class AddressIndexTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [INDEX_ARGS, INDEX_ARGS])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def disconnect_nodes(self):
+        for peer in self.nodes[0].getpeerinfo():
+            self.nodes[0].disconnectnode(peer["addr"])
+        while self.nodes[0].getconnectioncount() > 0 or self.nodes[1].getconnectioncount() > 0:
+            time.sleep(0.1)
+
+    def index_state(self, node, address, txid, vout):
+        query = {"addresses": [address]}
+        try:
+            spent = node.getspentinfo({"txid": txid, "index": vout})
+        except JSONRPCException:
+            spent = None
+        return (node.getaddressbalance(query), node.getaddressdeltas(query),
+                node.getaddressutxos(query), node.getaddresstxids(query), spent)
+
+    def check_nodes_agree(self, address, txid, vout):
+        state = self.index_state(self.nodes[0], address, txid, vout)
+        for node in self.nodes[1:]:
+            assert_equal(self.index_state(node, address, txid, vout), state)
+        return state
+
+    def run_test(self):
+        print "Mining blocks..."
+        self.nodes[0].setgenerate(True, 1)
+        self.sync_all()
+        self.nodes[1].setgenerate(True, 20)
+        self.sync_all()
+
+        self.nodes[1].importprivkey(PRIVKEY, "addressindex", False)
+        address = self.nodes[1].getaddressesbyaccount("addressindex")[0]
+        txid = self.nodes[0].sendtoaddress(address, 10)
+        self.nodes[0].setgenerate(True, 1)
+        self.sync_all()
+        height = self.nodes[0].getblockcount()
+        vout = find_output(self.nodes[1], txid, 10)
+
+        print "Checking a received output..."
+        balance, deltas, utxos, txids, spent = self.check_nodes_agree(address, txid, vout)
+        assert_equal(balance, {"balance": 1000000000, "received": 1000000000})
+        assert_equal(len(deltas), 1)
+        assert_equal(deltas[0]["satoshis"], 1000000000)
+        assert_equal(deltas[0]["height"], height)
+        assert_equal(len(utxos), 1)
+        assert_equal(utxos[0]["txid"], txid)
+        assert_equal(utxos[0]["outputIndex"], vout)
+        assert_equal(txids, [txid])
+        assert_equal(spent, None)
+        state_received = (balance, deltas, utxos, txids, spent)
+
+        print "Spending it on one side of a split..."
+        self.disconnect_nodes()
+        rawtx = self.nodes[1].createrawtransaction([{"txid": txid, "vout": vout}], {self.nodes[0].getnewaddress(): 9.99})
+        signed = self.nodes[1].signrawtransaction(rawtx)
+        assert_equal(signed["complete"], True)
+        spend_txid = self.nodes[1].sendrawtransaction(signed["hex"])
+        self.nodes[1].setgenerate(True, 1)
+
+        balance, deltas, utxos, txids, spent = self.index_state(self.nodes[1], address, txid, vout)
+        assert_equal(balance, {"balance": 0, "received": 1000000000})
+        assert_equal([d["satoshis"] for d in deltas], [1000000000, -1000000000])
+        assert_equal(deltas[1]["txid"], spend_txid)
+        assert_equal(deltas[1]["height"], height + 1)
+        assert_equal(utxos, [])
+        assert_equal(txids, [txid, spend_txid])
+        assert_equal(spent["txid"], spend_txid)
+        assert_equal(spent["height"], height + 1)
+
+        print "Reorganizing to the longer side without the spend..."
+        self.nodes[0].setgenerate(True, 2)
+        connect_nodes_bi(self.nodes, 0, 1)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[1].getblockcount(), height + 2)
+        assert_equal(self.check_nodes_agree(address, txid, vout), state_received)
+
+        print "Mining the spend again after the reorg..."
+        assert(spend_txid in self.nodes[1].getrawmempool())
+        self.nodes[1].setgenerate(True, 1)
+        sync_blocks(self.nodes)
+        balance, deltas, utxos, txids, spent = self.check_nodes_agree(address, txid, vout)
+        assert_equal(balance, {"balance": 0, "received": 1000000000})
+        assert_equal([d["satoshis"] for d in deltas], [1000000000, -1000000000])
+        assert_equal(deltas[1]["height"], height + 3)
+        assert_equal(utxos, [])
+        assert_equal(txids, [txid, spend_txid])
+        assert_equal(spent["height"], height + 3)
+        state_reorged = (balance, deltas, utxos, txids, spent)
+
+        print "Rebuilding the indexes with -reindex..."
+        blocks = self.nodes[1].getblockcount()
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, INDEX_ARGS + ["-reindex"])
+        while self.nodes[1].getblockcount() < blocks:
+            time.sleep(1)
+        assert_equal(self.index_state(self.nodes[1], address, txid, vout), state_reorged)
+        print "Success"
+
+if __name__ == '__main__':
+    AddressIndexTest().main()
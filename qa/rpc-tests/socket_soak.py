@@ -0,0 +1,106 @@
+#!/usr/bin/env python2
+# Copyright (c) 2019 The Mktcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Soak the socket handler with thousands of loopback peers.
+#
+# Opens more inbound connections than fit in an fd_set, has every one of
+# them send a version message, checks that each gets a version back and
+# that the node stays responsive, then drops them all. Not part of the
+# default rpc-tests.sh run; start it by hand:
+#
+#   qa/rpc-tests/socket_soak.py --srcdir src --connections 3000
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+import hashlib
+import random
+import resource
+import socket
+import struct
+import time
+
+REGTEST_MAGIC = b"\x93\x9f\xb6\xd8"
+PROTOCOL_VERSION = 90155
+
+def msg(command, payload):
+    checksum = hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    return REGTEST_MAGIC + struct.pack("<12sI", command, len(payload)) + checksum + payload
+
+def version_payload():
+    addr = struct.pack("<Q", 1) + b"\x00" * 10 + b"\xff\xff" + socket.inet_aton("127.0.0.1") + struct.pack(">H", 0)
+    return (struct.pack("<iQq", PROTOCOL_VERSION, 1, int(time.time())) + addr + addr +
+            struct.pack("<Q", random.getrandbits(64)) + b"\x00" + struct.pack("<i", 0))
+
+class SocketSoakTest (BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--connections", dest="connections", default=2000, type="int",
+                          help="Number of loopback peers to open")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self, split = False):
+        args = ["-maxconnections=%d" % (self.options.connections + 100), "-whitelist=127.0.0.1", "-dnsseed=0"]
+        self.nodes = start_nodes(1, self.options.tmpdir, [args])
+        self.is_network_split = False
+
+    def wait_for_connections(self, count, timeout=120):
+        deadline = time.time() + timeout
+        while self.nodes[0].getconnectioncount() != count:
+            assert time.time() < deadline, "connection count stuck at %d, expected %d" % (self.nodes[0].getconnectioncount(), count)
+            time.sleep(0.5)
+
+    def read_commands(self, s, count):
+        commands = []
+        for i in range(count):
+            header = self.read_exact(s, 24)
+            assert_equal(header[:4], REGTEST_MAGIC)
+            commands.append(header[4:16].rstrip(b"\x00"))
+            self.read_exact(s, struct.unpack("<I", header[16:20])[0])
+        return commands
+
+    def read_exact(self, s, n):
+        data = b""
+        while len(data) < n:
+            chunk = s.recv(n - len(data))
+            assert chunk, "connection closed by node"
+            data += chunk
+        return data
+
+    def run_test(self):
+        n = self.options.connections
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        if soft < n + 100:
+            resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, n + 100), hard))
+
+        print("Opening %d connections" % n)
+        socks = []
+        for i in range(n):
+            s = socket.create_connection(("127.0.0.1", p2p_port(0)))
+            s.settimeout(60)
+            socks.append(s)
+        self.wait_for_connections(n)
+
+        print("Exchanging version messages")
+        for s in socks:
+            s.sendall(msg(b"version", version_payload()))
+        for s in socks:
+            assert "version" in self.read_commands(s, 3)
+
+        # The node must still serve RPC and see every peer
+        assert_equal(len(self.nodes[0].getpeerinfo()), n)
+        self.nodes[0].getblockcount()
+
+        print("Closing connections")
+        for s in socks:
+            s.close()
+        self.wait_for_connections(0)
+
+if __name__ == '__main__':
+    SocketSoakTest().main()
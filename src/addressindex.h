@@ -0,0 +1,251 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "crypto/common.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * Records of the -addressindex and -spentindex block tree indexes.
+ *
+ * Keys are laid out so that LevelDB keeps the records of one address
+ * together, and within an address in block order: heights and transaction
+ * positions are written big endian.
+ */
+
+/** How the hash of an indexed address is to be read */
+enum AddressIndexType {
+    ADDRESS_NONE = 0,
+    ADDRESS_PUBKEYHASH = 1,
+    ADDRESS_SCRIPTHASH = 2,
+};
+
+template <typename Stream>
+inline void WriteIndexBE32(Stream& s, uint32_t n)
+{
+    unsigned char buf[4];
+    WriteBE32(buf, n);
+    s.write((char*)buf, 4);
+}
+
+template <typename Stream>
+inline uint32_t ReadIndexBE32(Stream& s)
+{
+    unsigned char buf[4];
+    s.read((char*)buf, 4);
+    return ReadBE32(buf);
+}
+
+/** A change to the balance of an address: an output paying it, or an input spending from it */
+struct CAddressIndexKey {
+    unsigned char type;
+    uint160 hashBytes;
+    int blockHeight;
+    unsigned int txindex;
+    uint256 txhash;
+    //! output index, or input index if spending
+    unsigned int index;
+    bool spending;
+
+    CAddressIndexKey() { SetNull(); }
+
+    CAddressIndexKey(unsigned char typeIn, const uint160& hashIn, int heightIn, unsigned int txindexIn,
+        const uint256& txhashIn, unsigned int indexIn, bool spendingIn) : type(typeIn), hashBytes(hashIn), blockHeight(heightIn),
+                                                                          txindex(txindexIn), txhash(txhashIn), index(indexIn), spending(spendingIn) {}
+
+    void SetNull()
+    {
+        type = ADDRESS_NONE;
+        hashBytes = 0;
+        blockHeight = 0;
+        txindex = 0;
+        txhash = 0;
+        index = 0;
+        spending = false;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, type, nType, nVersion);
+        hashBytes.Serialize(s, nType, nVersion);
+        WriteIndexBE32(s, blockHeight);
+        WriteIndexBE32(s, txindex);
+        txhash.Serialize(s, nType, nVersion);
+        ::Serialize(s, index, nType, nVersion);
+        ::Serialize(s, spending, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, type, nType, nVersion);
+        hashBytes.Unserialize(s, nType, nVersion);
+        blockHeight = ReadIndexBE32(s);
+        txindex = ReadIndexBE32(s);
+        txhash.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, index, nType, nVersion);
+        ::Unserialize(s, spending, nType, nVersion);
+    }
+};
+
+/** Prefix of the CAddressIndexKey records of one address, optionally starting at a height */
+struct CAddressIndexIteratorKey {
+    unsigned char type;
+    uint160 hashBytes;
+    int blockHeight;
+
+    CAddressIndexIteratorKey(unsigned char typeIn, const uint160& hashIn, int heightIn = -1) : type(typeIn), hashBytes(hashIn), blockHeight(heightIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + (blockHeight >= 0 ? 4 : 0);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, type, nType, nVersion);
+        hashBytes.Serialize(s, nType, nVersion);
+        if (blockHeight >= 0)
+            WriteIndexBE32(s, blockHeight);
+    }
+};
+
+/** An unspent output of an address */
+struct CAddressUnspentKey {
+    unsigned char type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int index;
+
+    CAddressUnspentKey() : type(ADDRESS_NONE), hashBytes(0), txhash(0), index(0) {}
+    CAddressUnspentKey(unsigned char typeIn, const uint160& hashIn, const uint256& txhashIn, unsigned int indexIn) : type(typeIn), hashBytes(hashIn), txhash(txhashIn), index(indexIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(type);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(index);
+    }
+};
+
+/** Prefix of the CAddressUnspentKey records of one address */
+struct CAddressUnspentIteratorKey {
+    unsigned char type;
+    uint160 hashBytes;
+
+    CAddressUnspentIteratorKey(unsigned char typeIn, const uint160& hashIn) : type(typeIn), hashBytes(hashIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(type);
+        READWRITE(hashBytes);
+    }
+};
+
+/** The output itself; a null value in an update erases the record */
+struct CAddressUnspentValue {
+    CAmount satoshis;
+    CScript script;
+    int blockHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(CAmount satoshisIn, const CScript& scriptIn, int heightIn) : satoshis(satoshisIn), script(scriptIn), blockHeight(heightIn) {}
+
+    void SetNull()
+    {
+        satoshis = -1;
+        script.clear();
+        blockHeight = 0;
+    }
+
+    bool IsNull() const { return satoshis == -1; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(satoshis);
+        READWRITE(script);
+        READWRITE(blockHeight);
+    }
+};
+
+/** An output that has been spent */
+struct CSpentIndexKey {
+    uint256 txid;
+    unsigned int outputIndex;
+
+    CSpentIndexKey() : txid(0), outputIndex(0) {}
+    CSpentIndexKey(const uint256& txidIn, unsigned int outputIndexIn) : txid(txidIn), outputIndex(outputIndexIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(outputIndex);
+    }
+};
+
+/** The input spending it, with what the output held; a null value in an update erases the record */
+struct CSpentIndexValue {
+    uint256 txid;
+    unsigned int inputIndex;
+    int blockHeight;
+    CAmount satoshis;
+    unsigned char addressType;
+    uint160 addressHash;
+
+    CSpentIndexValue() { SetNull(); }
+    CSpentIndexValue(const uint256& txidIn, unsigned int inputIndexIn, int heightIn, CAmount satoshisIn, unsigned char typeIn, const uint160& hashIn) : txid(txidIn), inputIndex(inputIndexIn), blockHeight(heightIn),
+                                                                                                                                                       satoshis(satoshisIn), addressType(typeIn), addressHash(hashIn) {}
+
+    void SetNull()
+    {
+        txid = 0;
+        inputIndex = 0;
+        blockHeight = 0;
+        satoshis = 0;
+        addressType = ADDRESS_NONE;
+        addressHash = 0;
+    }
+
+    bool IsNull() const { return txid == 0; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(inputIndex);
+        READWRITE(blockHeight);
+        READWRITE(satoshis);
+        READWRITE(addressType);
+        READWRITE(addressHash);
+    }
+};
+
+#endif // BITCOIN_ADDRESSINDEX_H
@@ -0,0 +1,25 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/quark.h"
+#include "crypto/sha256.h"
+#include "util.h"
+
+#include <iostream>
+
+int
+main(int argc, char** argv)
+{
+    std::string sha256_algo = SHA256AutoDetect();
+    std::string quark_algo = QuarkAutoDetect();
+    SetupEnvironment();
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+
+    std::cout << "#SHA256 implementation: " << sha256_algo << "\n";
+    std::cout << "#Quark implementation: " << quark_algo << "\n";
+    benchmark::BenchRunner::RunAll();
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static CMutableTransaction SpendOutput(const uint256& hashPrev)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = 1 * COIN;
+    return tx;
+}
+
+/* A mempool of nTx transactions, one in four of them spending another mempool transaction */
+static void FillPool(CTxMemPool& pool, int nTx)
+{
+    seed_insecure_rand(true);
+    std::vector<uint256> vHashes;
+    vHashes.reserve(nTx);
+    LOCK(pool.cs);
+    for (int i = 0; i < nTx; i++) {
+        uint256 hashPrev;
+        if (!vHashes.empty() && insecure_rand() % 4 == 0)
+            hashPrev = vHashes[insecure_rand() % vHashes.size()];
+        else
+            hashPrev = GetRandHash();
+        CMutableTransaction tx = SpendOutput(hashPrev);
+        tx.vout[0].nValue -= insecure_rand() % 1000;
+        CAmount nFee = 1000 + insecure_rand() % 99000;
+        uint256 hash = tx.GetHash();
+        pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, 0, 0.0, 1, 1));
+        vHashes.push_back(hash);
+    }
+}
+
+/* A new low-fee transaction arrives, then the next template is requested */
+static void BlockTemplateIncremental(benchmark::State& state, int nTx)
+{
+    CTxMemPool pool(CFeeRate(0));
+    FillPool(pool, nTx);
+    CBlockTemplateCache cache(pool);
+    uint256 hashPrevBlock = GetRandHash();
+    std::vector<CTxMemPool::txiter> vtx;
+    LOCK(pool.cs);
+    cache.GetSelection(hashPrevBlock, 2, vtx);
+    while (state.KeepRunning()) {
+        CMutableTransaction tx = SpendOutput(GetRandHash());
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0.0, 1, 1));
+        cache.GetSelection(hashPrevBlock, 2, vtx);
+    }
+}
+
+/* A new tip every time, so the selection is rebuilt from the whole mempool */
+static void BlockTemplateRebuild(benchmark::State& state, int nTx)
+{
+    CTxMemPool pool(CFeeRate(0));
+    FillPool(pool, nTx);
+    CBlockTemplateCache cache(pool);
+    std::vector<CTxMemPool::txiter> vtx;
+    LOCK(pool.cs);
+    while (state.KeepRunning())
+        cache.GetSelection(GetRandHash(), 2, vtx);
+}
+
+static void BlockTemplateIncremental_10k(benchmark::State& state) { BlockTemplateIncremental(state, 10000); }
+static void BlockTemplateIncremental_50k(benchmark::State& state) { BlockTemplateIncremental(state, 50000); }
+static void BlockTemplateIncremental_100k(benchmark::State& state) { BlockTemplateIncremental(state, 100000); }
+static void BlockTemplateRebuild_10k(benchmark::State& state) { BlockTemplateRebuild(state, 10000); }
+static void BlockTemplateRebuild_50k(benchmark::State& state) { BlockTemplateRebuild(state, 50000); }
+static void BlockTemplateRebuild_100k(benchmark::State& state) { BlockTemplateRebuild(state, 100000); }
+
+BENCHMARK(BlockTemplateIncremental_10k);
+BENCHMARK(BlockTemplateIncremental_50k);
+BENCHMARK(BlockTemplateIncremental_100k);
+BENCHMARK(BlockTemplateRebuild_10k);
+BENCHMARK(BlockTemplateRebuild_50k);
+BENCHMARK(BlockTemplateRebuild_100k);
@@ -0,0 +1,82 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/quark.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+
+#include <vector>
+
+/* Number of bytes to hash per iteration */
+static const uint64_t BUFFER_SIZE = 1000*1000;
+
+static void SHA256_1M(benchmark::State& state)
+{
+    uint8_t hash[CSHA256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(BUFFER_SIZE,0);
+    while (state.KeepRunning())
+        CSHA256().Write(begin_ptr(in), in.size()).Finalize(hash);
+}
+
+static void SHA256_32b(benchmark::State& state)
+{
+    std::vector<uint8_t> in(32,0);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000000; i++) {
+            CSHA256().Write(begin_ptr(in), in.size()).Finalize(&in[0]);
+        }
+    }
+}
+
+/* 1024 independent 64-byte inputs: one merkle level of a 2048 transaction block */
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D64(&out[0], &in[0], 1024);
+}
+
+/* The same level hashed one pair at a time, as the merkle builder used to */
+static void SHA256D64_1024_Serial(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++)
+            CHash256().Write(&in[64 * i], 64).Finalize(&out[32 * i]);
+    }
+}
+
+/* 1024 legacy block headers, as loaded from the block index */
+static void HashQuark_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024);
+    std::vector<uint8_t> out(32 * 1024);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = i * 13;
+    while (state.KeepRunning())
+        HashQuark80(&out[0], &in[0], 1024);
+}
+
+static void HashQuark_1024_Serial(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = i * 13;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++)
+            HashQuark(&in[80 * i], &in[80 * i + 80]);
+    }
+}
+
+BENCHMARK(SHA256_1M);
+BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(SHA256D64_1024_Serial);
+BENCHMARK(HashQuark_1024);
+BENCHMARK(HashQuark_1024_Serial);
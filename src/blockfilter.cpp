@@ -0,0 +1,269 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "version.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+namespace
+{
+/** Writes bits to a stream, most significant bit first */
+template <typename Stream>
+class CBitWriter
+{
+private:
+    Stream& stream;
+    uint8_t nBuffer;
+    int nOffset;
+
+public:
+    CBitWriter(Stream& streamIn) : stream(streamIn), nBuffer(0), nOffset(0) {}
+    ~CBitWriter() { Flush(); }
+
+    //! Write the nBits low bits of data, 0 <= nBits <= 64
+    void Write(uint64_t data, int nBits)
+    {
+        while (nBits > 0) {
+            int nChunk = std::min(8 - nOffset, nBits);
+            nBuffer |= (data << (64 - nBits)) >> (64 - 8 + nOffset);
+            nOffset += nChunk;
+            nBits -= nChunk;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    //! Write the partial byte, padded with zero bits
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        stream << nBuffer;
+        nBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+/** Reads bits from a stream, most significant bit first */
+template <typename Stream>
+class CBitReader
+{
+private:
+    Stream& stream;
+    uint8_t nBuffer;
+    int nOffset;
+
+public:
+    CBitReader(Stream& streamIn) : stream(streamIn), nBuffer(0), nOffset(8) {}
+
+    //! Read nBits bits, 0 <= nBits <= 64; throws std::ios_base::failure past the end
+    uint64_t Read(int nBits)
+    {
+        uint64_t data = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                stream >> nBuffer;
+                nOffset = 0;
+            }
+            int nChunk = std::min(8 - nOffset, nBits);
+            data <<= nChunk;
+            data |= (uint8_t)(nBuffer << nOffset) >> (8 - nChunk);
+            nOffset += nChunk;
+            nBits -= nChunk;
+        }
+        return data;
+    }
+};
+
+template <typename Stream>
+void GolombRiceEncode(CBitWriter<Stream>& writer, uint8_t P, uint64_t x)
+{
+    // Quotient in unary: q ones and a zero
+    uint64_t q = x >> P;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+
+    writer.Write(x, P);
+}
+
+template <typename Stream>
+uint64_t GolombRiceDecode(CBitReader<Stream>& reader, uint8_t P)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    uint64_t r = reader.Read(P);
+    return (q << P) + r;
+}
+
+/** Map a uniform 64-bit hash to [0, n) by multiplication, the high 64 bits of x * n */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return ((unsigned __int128)x * n) >> 64;
+#else
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+} // namespace
+
+CGCSFilter::CGCSFilter() : k0(0), k1(0), N(0), F(0), vEncoded(1, 0)
+{
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, const std::vector<unsigned char>& vEncodedIn) : k0(k0In), k1(k1In), vEncoded(vEncodedIn)
+{
+    CDataStream stream(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    N = ReadCompactSize(stream);
+    F = N * M;
+
+    // Decode the whole filter once, so that a corrupt one is refused here
+    CBitReader<CDataStream> reader(stream);
+    for (uint64_t i = 0; i < N; i++)
+        GolombRiceDecode(reader, P);
+    if (!stream.empty())
+        throw std::ios_base::failure("encoded filter contains excess data");
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, const ElementSet& elements) : k0(k0In), k1(k1In)
+{
+    N = elements.size();
+    F = N * M;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(stream, N);
+    {
+        CBitWriter<CDataStream> writer(stream);
+        std::vector<uint64_t> vHashes = BuildHashedSet(elements);
+        uint64_t nLast = 0;
+        for (unsigned int i = 0; i < vHashes.size(); i++) {
+            GolombRiceEncode(writer, P, vHashes[i] - nLast);
+            nLast = vHashes[i];
+        }
+    }
+    vEncoded.assign(stream.begin(), stream.end());
+}
+
+uint64_t CGCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(k0, k1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(hash, F);
+}
+
+std::vector<uint64_t> CGCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); it++)
+        vHashes.push_back(HashToRange(*it));
+    std::sort(vHashes.begin(), vHashes.end());
+    return vHashes;
+}
+
+bool CGCSFilter::MatchInternal(const uint64_t* pElementHashes, size_t nSize) const
+{
+    CDataStream stream(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    ReadCompactSize(stream);
+    CBitReader<CDataStream> reader(stream);
+
+    // Walk the filter and the sorted queries side by side
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint64_t i = 0; i < N; i++) {
+        nValue += GolombRiceDecode(reader, P);
+        while (true) {
+            if (nQuery == nSize)
+                return false;
+            if (pElementHashes[nQuery] == nValue)
+                return true;
+            if (pElementHashes[nQuery] > nValue)
+                break;
+            nQuery++;
+        }
+    }
+    return false;
+}
+
+bool CGCSFilter::Match(const Element& element) const
+{
+    if (N == 0)
+        return false;
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool CGCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (N == 0 || elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries = BuildHashedSet(elements);
+    return MatchInternal(vQueries.data(), vQueries.size());
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded) : hashBlock(hashBlockIn)
+{
+    SetFilter(vEncoded);
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockundo) : hashBlock(block.GetHash())
+{
+    CGCSFilter::ElementSet elements;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH (const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH (const CTxInUndo& undo, txundo.vprevout) {
+            const CScript& script = undo.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    // The first 16 bytes of the block hash key the SipHash
+    filter = CGCSFilter(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), elements);
+}
+
+void CBlockFilter::SetFilter(const std::vector<unsigned char>& vEncoded)
+{
+    filter = CGCSFilter(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), vEncoded);
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vEncoded = filter.GetEncoded();
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    const uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
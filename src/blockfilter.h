@@ -0,0 +1,113 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * Golomb-coded set: a compact probabilistic set of byte strings, as in BIP 158.
+ *
+ * Elements are hashed with SipHash into [0, N * M) and the sorted hashes are
+ * written as Golomb-Rice coded deltas with parameter P. A query for an
+ * element not in the set matches with probability about 1/M.
+ */
+class CGCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    static const uint8_t P = 19;
+    static const uint64_t M = 784931;
+
+private:
+    uint64_t k0;
+    uint64_t k1;
+    uint64_t N;
+    uint64_t F;
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    //! Whether any of the sorted hashes is in the filter
+    bool MatchInternal(const uint64_t* pElementHashes, size_t nSize) const;
+
+public:
+    //! An empty filter
+    CGCSFilter();
+    //! Wrap an encoded filter; throws std::ios_base::failure if it is malformed
+    CGCSFilter(uint64_t k0In, uint64_t k1In, const std::vector<unsigned char>& vEncodedIn);
+    CGCSFilter(uint64_t k0In, uint64_t k1In, const ElementSet& elements);
+
+    uint64_t GetN() const { return N; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    bool Match(const Element& element) const;
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+enum BlockFilterType {
+    //! Output scripts of a block and the scripts of the outputs it spends
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/**
+ * The basic BIP 158 filter of a block: the scripts of the outputs it creates,
+ * except OP_RETURN outputs, and of the outputs it spends. A wallet can test
+ * its scripts against it to tell whether the block may pay to or spend from
+ * it, without reading the block.
+ */
+class CBlockFilter
+{
+private:
+    uint256 hashBlock;
+    CGCSFilter filter;
+
+    void SetFilter(const std::vector<unsigned char>& vEncoded);
+
+public:
+    CBlockFilter() {}
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded);
+    //! Build the filter; the spent outputs come from the block's undo data
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockundo);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    uint256 GetHash() const;
+    //! Filter header committing to this filter and all before it
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint8_t nFilterType = BLOCK_FILTER_BASIC;
+        READWRITE(nFilterType);
+        READWRITE(hashBlock);
+        std::vector<unsigned char> vEncoded;
+        if (!ser_action.ForRead())
+            vEncoded = filter.GetEncoded();
+        READWRITE(vEncoded);
+        if (ser_action.ForRead()) {
+            if (nFilterType != BLOCK_FILTER_BASIC)
+                throw std::ios_base::failure("unknown block filter type");
+            SetFilter(vEncoded);
+        }
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
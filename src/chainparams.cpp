@@ -101,6 +101,7 @@ public:
         nDefaultPort = 17223;
         bnProofOfWorkLimit = ~uint256(0) >> 20; // MCH starting difficulty is 1 / 2^12
         nMaxReorganizationDepth = 100;
+        nPruneAfterHeight = 100000;
         nMinerThreads = 0;
         nTargetTimespan = 1 * 60; // MCH: 1 day
         nTargetSpacing = 4 * 60;  // MCH: 1 minute
@@ -191,6 +192,7 @@ public:
         pchMessageStart[3] = 0x96;
         vAlertPubKey = ParseHex("047702b6eb08ee32cfbd0cec8197e7287bc46aa3b9b855f268378a8e217eb1f7232dbca8f4e3459758ac2fd476a41266d8ce4ee19e3cacd5169802a9715bf572d1");
         nDefaultPort = 31244;
+        nPruneAfterHeight = 1000;
         nMinerThreads = 0;
         nTargetTimespan = 1 * 60; // MCH: 1 day
         nTargetSpacing = 1 * 60;  // MCH: 1 minute
@@ -263,6 +265,7 @@ public:
         pchMessageStart[2] = 0xb6;
         pchMessageStart[3] = 0xd8;
         nSubsidyHalvingInterval = 150;
+        nPruneAfterHeight = 1000;
         nMinerThreads = 1;
         nTargetTimespan = 24 * 60 * 60; // MCH: 1 day
         nTargetSpacing = 1 * 60;        // MCH: 1 minutes
@@ -53,6 +53,9 @@ public:
     /** Used to check block reorganization */
     int MaxReorganizationDepth() const { return nMaxReorganizationDepth; }
 
+    /** Height below which -prune does not delete block files */
+    int PruneAfterHeight() const { return nPruneAfterHeight; }
+
     /** Used if GenerateBitcoins is called with a negative number of threads */
     int DefaultMinerThreads() const { return nMinerThreads; }
     const CBlock& GenesisBlock() const { return genesis; }
@@ -111,6 +114,7 @@ protected:
     int nDefaultPort;
     uint256 bnProofOfWorkLimit;
     int nMaxReorganizationDepth;
+    int nPruneAfterHeight;
     int nSubsidyHalvingInterval;
     int64_t nTargetTimespan;
     int64_t nTargetSpacing;
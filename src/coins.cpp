@@ -5,71 +5,70 @@
 
 #include "coins.h"
 
+#include "clientversion.h"
+#include "memusage.h"
+#include "primitives/block.h"
 #include "random.h"
+#include "streams.h"
+#include "version.h"
 
 #include <assert.h>
+#include <stdexcept>
 
-/**
- * calculate number of bytes for the bitmask, and its number of non-zero bytes
- * each bit in the bitmask represents the availability of one output, but the
- * availabilities of the first two outputs are encoded separately
- */
-void CCoins::CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const
-{
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2 + b * 8 < vout.size(); b++) {
-        bool fZero = true;
-        for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++) {
-            if (!vout[2 + b * 8 + i].IsNull()) {
-                fZero = false;
-                continue;
-            }
-        }
-        if (!fZero) {
-            nLastUsedByte = b + 1;
-            nNonzeroBytes++;
-        }
-    }
-    nBytes += nLastUsedByte;
+bool CCoinsView::GetCoin(const COutPoint& outpoint, Coin& coin) const { return false; }
+bool CCoinsView::HaveCoin(const COutPoint& outpoint) const
+{
+    Coin coin;
+    return GetCoin(outpoint, coin);
 }
+uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
+bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
+bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 
-bool CCoins::Spend(const COutPoint& out, CTxInUndo& undo)
+/** The element a coin contributes to the UTXO set muhash: outpoint, height and coinbase/coinstake flags, output */
+static CDataStream MuHashElement(const COutPoint& outpoint, const Coin& coin)
 {
-    if (out.n >= vout.size())
-        return false;
-    if (vout[out.n].IsNull())
-        return false;
-
-    undo = CTxInUndo(vout[out.n]);
-    vout[out.n].SetNull();
-    Cleanup();
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << outpoint;
+    ss << VARINT(coin.nHeight * 4 + (coin.fCoinStake ? 2 : 0) + (coin.fCoinBase ? 1 : 0));
+    ss << coin.out;
+    return ss;
+}
 
-    if (vout.size() == 0) {
-        undo.nHeight = nHeight;
-        undo.fCoinBase = fCoinBase;
-        undo.fCoinStake = fCoinStake;
-        undo.nVersion = this->nVersion;
-    }
+/** Size of the chainstate database record of a coin, key 'C' + txid + VARINT(n) plus value, as counted by a scan */
+static uint64_t GetCoinRecordSize(const COutPoint& outpoint, const Coin& coin)
+{
+    return 1 + sizeof(outpoint.hash) + GetSizeOfVarInt(outpoint.n) + coin.GetSerializeSize(SER_DISK, CLIENT_VERSION);
+}
 
-    return true;
+void CCoinsStats::AddCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss = MuHashElement(outpoint, coin);
+    muhash.Insert((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs++;
+    nSerializedSize += GetCoinRecordSize(outpoint, coin);
+    nTotalAmount += coin.out.nValue;
 }
 
-bool CCoins::Spend(int nPos)
+void CCoinsStats::SpendCoin(const COutPoint& outpoint, const Coin& coin)
 {
-    CTxInUndo undo;
-    COutPoint out(0, nPos);
-    return Spend(out, undo);
+    CDataStream ss = MuHashElement(outpoint, coin);
+    muhash.Remove((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs--;
+    nSerializedSize -= GetCoinRecordSize(outpoint, coin);
+    nTotalAmount -= coin.out.nValue;
 }
 
-bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
-bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
-uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
-bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
+uint256 CCoinsStats::GetMuHash() const
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
-bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
+bool CCoinsViewBacked::GetCoin(const COutPoint& outpoint, Coin& coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint& outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
@@ -77,78 +76,300 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsMap::iterator CCoinsMap::find(const COutPoint& key)
+{
+    if (nUsed == 0)
+        return end();
+    uint64_t nHash = hasher(key);
+    unsigned char nControl = CONTROL_USED | (nHash >> 57);
+    size_t nMask = vControl.size() - 1;
+    for (size_t pos = nHash & nMask;; pos = (pos + 1) & nMask) {
+        if (vControl[pos] == CONTROL_EMPTY)
+            return end();
+        if (vControl[pos] == nControl && vEntries[pos].first == key)
+            return iterator(this, pos);
+    }
+}
 
-CCoinsViewCache::~CCoinsViewCache()
+std::pair<CCoinsMap::iterator, bool> CCoinsMap::insert(const COutPoint& key)
 {
-    assert(!hasModifier);
+    // Keep at least a quarter of the slots empty, so probe sequences stay short
+    if ((nUsed + nErased + 1) * 4 > vControl.size() * 3) {
+        size_t nCapacity = 16;
+        while (nCapacity * 3 < (nUsed + 1) * 8)
+            nCapacity <<= 1;
+        Rehash(nCapacity);
+    }
+
+    uint64_t nHash = hasher(key);
+    unsigned char nControl = CONTROL_USED | (nHash >> 57);
+    size_t nMask = vControl.size() - 1;
+    size_t posFree = vControl.size();
+    size_t pos = nHash & nMask;
+    for (;; pos = (pos + 1) & nMask) {
+        if (vControl[pos] == CONTROL_EMPTY)
+            break;
+        if (vControl[pos] == CONTROL_ERASED) {
+            if (posFree == vControl.size())
+                posFree = pos;
+        } else if (vControl[pos] == nControl && vEntries[pos].first == key) {
+            return std::make_pair(iterator(this, pos), false);
+        }
+    }
+    if (posFree != vControl.size()) {
+        // Reuse the first erased slot on the probe sequence
+        pos = posFree;
+        nErased--;
+    }
+    vControl[pos] = nControl;
+    vEntries[pos].first = key;
+    nUsed++;
+    return std::make_pair(iterator(this, pos), true);
+}
+
+void CCoinsMap::erase(iterator it)
+{
+    assert(vControl[it.pos] >= CONTROL_USED);
+    vControl[it.pos] = CONTROL_ERASED;
+    vEntries[it.pos].second.coin.Clear();
+    vEntries[it.pos].second.flags = 0;
+    nUsed--;
+    nErased++;
+}
+
+void CCoinsMap::clear()
+{
+    std::vector<value_type>().swap(vEntries);
+    std::vector<unsigned char>().swap(vControl);
+    nUsed = 0;
+    nErased = 0;
+}
+
+void CCoinsMap::swap(CCoinsMap& other)
+{
+    std::swap(hasher, other.hasher);
+    vEntries.swap(other.vEntries);
+    vControl.swap(other.vControl);
+    std::swap(nUsed, other.nUsed);
+    std::swap(nErased, other.nErased);
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(vEntries.capacity() * sizeof(value_type)) + memusage::MallocUsage(vControl.capacity());
 }
 
-CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
+void CCoinsMap::Rehash(size_t nCapacity)
+{
+    std::vector<value_type> vEntriesNew(nCapacity);
+    std::vector<unsigned char> vControlNew(nCapacity, CONTROL_EMPTY);
+    size_t nMask = nCapacity - 1;
+    for (size_t posOld = 0; posOld < vControl.size(); posOld++) {
+        if (vControl[posOld] < CONTROL_USED)
+            continue;
+        size_t pos = hasher(vEntries[posOld].first) & nMask;
+        while (vControlNew[pos] != CONTROL_EMPTY)
+            pos = (pos + 1) & nMask;
+        vControlNew[pos] = vControl[posOld];
+        vEntriesNew[pos].first = vEntries[posOld].first;
+        vEntriesNew[pos].second.coin.swap(vEntries[posOld].second.coin);
+        vEntriesNew[pos].second.flags = vEntries[posOld].second.flags;
+    }
+    vEntries.swap(vEntriesNew);
+    vControl.swap(vControlNew);
+    nErased = 0;
+}
+
+CCoinsViewFlushQueue::CCoinsViewFlushQueue(CCoinsView* viewIn) : CCoinsViewBacked(viewIn), hashPending(0), fPending(false), fFailed(false) {}
+
+bool CCoinsViewFlushQueue::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CCoinsMap::iterator it = cacheCoins.find(txid);
+    {
+        LOCK(cs);
+        CCoinsMap::iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewFlushQueue::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        LOCK(cs);
+        CCoinsMap::iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end())
+            return !it->second.coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewFlushQueue::GetBestBlock() const
+{
+    {
+        LOCK(cs);
+        if (fPending)
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlushQueue::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    LOCK(cs);
+    if (fFailed)
+        return false;
+    assert(!fPending);
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    fPending = true;
+    return true;
+}
+
+bool CCoinsViewFlushQueue::WritePending()
+{
+    {
+        LOCK(cs);
+        if (fFailed)
+            return false;
+        if (!fPending)
+            return true;
+    }
+    // Only this function and BatchWrite() modify the pending batch, and they never run
+    // at the same time, so the base can read it without the lock while lookups go on.
+    bool fOk = false;
+    try {
+        fOk = base->BatchWrite(mapPending, hashPending);
+    } catch (...) {
+        LOCK(cs);
+        fFailed = true;
+        throw;
+    }
+    if (!fOk) {
+        // Keep the batch for lookups; the coins on disk are behind it now
+        LOCK(cs);
+        fFailed = true;
+        return false;
+    }
+    LOCK(cs);
+    mapPending.clear();
+    fPending = false;
+    return true;
+}
+
+size_t CCoinsViewFlushQueue::GetPendingSize() const
+{
+    LOCK(cs);
+    return mapPending.size();
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hashBlock(0), cachedCoinsUsage(0) {}
+
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
     if (it != cacheCoins.end())
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    Coin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
-    tmp.swap(ret->second.coins);
-    if (ret->second.coins.IsPruned()) {
-        // The parent only has an empty entry for this txid; we can consider our
+    CCoinsMap::iterator ret = cacheCoins.insert(outpoint).first;
+    ret->second.coin.swap(tmp);
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
-bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewCache::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coins = it->second.coins;
-        return true;
+        coin = it->second.coin;
+        return !coin.IsSpent();
     }
     return false;
 }
 
-CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
+void CCoinsViewCache::AddCoin(const COutPoint& outpoint, const Coin& coin, bool possible_overwrite)
 {
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
-            // The parent view does not have this entry; mark it as fresh.
-            ret.first->second.coins.Clear();
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        }
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable())
+        return;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(outpoint);
+    CCoinsCacheEntry& entry = ret.first->second;
+    bool fresh = false;
+    if (!ret.second)
+        cachedCoinsUsage -= entry.coin.DynamicMemoryUsage();
+    if (!possible_overwrite) {
+        if (!entry.coin.IsSpent())
+            throw std::logic_error("Adding new coin that replaces non-pruned entry");
+        // A spent entry that is not dirty matches what the parent has (nothing)
+        fresh = !(entry.flags & CCoinsCacheEntry::DIRTY);
     }
-    // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    entry.coin = coin;
+    entry.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
 }
 
-const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight)
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    if (it == cacheCoins.end()) {
-        return NULL;
+    bool fCoinBase = tx.IsCoinBase();
+    bool fCoinStake = tx.IsCoinStake();
+    const uint256& txid = tx.GetHash();
+    for (size_t i = 0; i < tx.vout.size(); ++i) {
+        // Coinbases may have been duplicated before BIP30, so let them overwrite
+        cache.AddCoin(COutPoint(txid, i), Coin(tx.vout[i], nHeight, fCoinBase, fCoinStake), fCoinBase);
+    }
+}
+
+bool CCoinsViewCache::SpendCoin(const COutPoint& outpoint, Coin* moveto)
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end())
+        return false;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (moveto)
+        moveto->swap(it->second.coin);
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        cacheCoins.erase(it);
     } else {
-        return &it->second.coins;
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
     }
+    return true;
+}
+
+static const Coin coinEmpty;
+
+const Coin& CCoinsViewCache::AccessCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end())
+        return coinEmpty;
+    return it->second.coin;
+}
+
+bool CCoinsViewCache::HaveCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256& txid) const
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint& outpoint) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    // We're using vtx.empty() instead of IsPruned here for performance reasons,
-    // as we only care about the case where a transaction was replaced entirely
-    // in a reorganization (which wipes vout entirely, as opposed to spending
-    // which just cleans individual outputs).
-    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
 uint256 CCoinsViewCache::GetBestBlock() const
@@ -166,37 +387,44 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
 {
-    assert(!hasModifier);
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
-            CCoinsMap::iterator itUs = cacheCoins.find(it->first);
-            if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
-                    // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
-                    CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
-                }
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue; // Ignore non-dirty entries (optimization).
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // The parent cache does not have an entry, while the child does.
+            // We can ignore it if it's both FRESH and spent in the child.
+            if (!((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())) {
+                // Otherwise create it in the parent, move the data up and mark
+                // it dirty. It can only be FRESH in the parent if it was in the
+                // child, as otherwise it may just have been flushed from the
+                // parent's cache and exist in the grandparent.
+                CCoinsCacheEntry& entry = cacheCoins.insert(it->first).first->second;
+                entry.coin.swap(it->second.coin);
+                cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+                entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & CCoinsCacheEntry::FRESH);
+            }
+        } else {
+            // A child entry can only be FRESH if the parent has nothing unspent for it.
+            if ((it->second.flags & CCoinsCacheEntry::FRESH) && !itUs->second.coin.IsSpent())
+                throw std::logic_error("FRESH flag misapplied to cache entry for unspent coin");
+
+            cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+            if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()) {
+                // The grandparent does not have an entry, and the child is
+                // modified and being spent. This means we can just delete
+                // it from the parent.
+                cacheCoins.erase(itUs);
             } else {
-                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-                    // The grandparent does not have an entry, and the child is
-                    // modified and being pruned. This means we can just delete
-                    // it from the parent.
-                    cacheCoins.erase(itUs);
-                } else {
-                    // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
-                }
+                // A normal modification. The child's FRESH flag is not copied:
+                // the parent's spent entry may still need to reach the grandparent.
+                itUs->second.coin.swap(it->second.coin);
+                cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
+                itUs->second.flags |= CCoinsCacheEntry::DIRTY;
             }
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
+    mapCoins.clear();
     hashBlock = hashBlockIn;
     return true;
 }
@@ -205,9 +433,30 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
+void CCoinsViewCache::Uncache(const COutPoint& outpoint)
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end() && it->second.flags == 0) {
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+        cacheCoins.erase(it);
+    }
+}
+
+void CCoinsViewCache::AddPrefetchedCoin(const COutPoint& outpoint, Coin& coin)
+{
+    std::pair<CCoinsMap::iterator, bool> inserted = cacheCoins.insert(outpoint);
+    if (!inserted.second)
+        return;
+    inserted.first->second.coin.swap(coin);
+    if (inserted.first->second.coin.IsSpent())
+        inserted.first->second.flags = CCoinsCacheEntry::FRESH;
+    cachedCoinsUsage += inserted.first->second.coin.DynamicMemoryUsage();
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -215,10 +464,9 @@ unsigned int CCoinsViewCache::GetCacheSize() const
 
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
-    assert(coins && coins->IsAvailable(input.prevout.n));
-
-    return coins->vout[input.prevout.n];
+    const Coin& coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 CAmount CCoinsViewCache::GetValueIn(const CTransaction& tx) const
@@ -237,9 +485,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 {
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
-            if (!coins || !coins->IsAvailable(prevout.n)) {
+            if (!HaveCoin(tx.vin[i].prevout)) {
                 return false;
             }
         }
@@ -255,29 +501,26 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     double dResult = 0.0;
     
     for (const CTxIn& txin:  tx.vin) {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
-        if (coins->nHeight < nHeight) {
-            dResult += coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight);
+        const Coin& coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if (coin.nHeight < nHeight) {
+            dResult += coin.out.nValue * (nHeight - coin.nHeight);
         }
     }
 
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
-{
-    assert(!cache.hasModifier);
-    cache.hasModifier = true;
-}
+static const size_t MAX_OUTPUTS_PER_BLOCK = MAX_BLOCK_SIZE_CURRENT / ::GetSerializeSize(CTxOut(), SER_NETWORK, PROTOCOL_VERSION);
 
-CCoinsModifier::~CCoinsModifier()
+const Coin& AccessByTxid(const CCoinsViewCache& view, const uint256& txid)
 {
-    assert(cache.hasModifier);
-    cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
+    COutPoint iter(txid, 0);
+    while (iter.n < MAX_OUTPUTS_PER_BLOCK) {
+        const Coin& alternate = view.AccessCoin(iter);
+        if (!alternate.IsSpent())
+            return alternate;
+        ++iter.n;
     }
+    return coinEmpty;
 }
@@ -47,6 +47,12 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#define USE_EPOLL
+#include <poll.h>
+#include <sys/epoll.h>
+#endif
+
 #ifdef WIN32
 #define MSG_DONTWAIT 0
 #else
@@ -96,7 +102,7 @@ size_t strnlen( const char *start, size_t max_len);
 
 bool static inline IsSelectableSocket(SOCKET s)
 {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -0,0 +1,174 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+namespace
+{
+typedef Num3072::limb_t limb_t;
+typedef Num3072::double_limb_t double_limb_t;
+
+/** 2^3072 - MAX_PRIME_DIFF is the largest 3072-bit prime */
+const limb_t MAX_PRIME_DIFF = 1103717;
+const limb_t LIMB_MAX = ~(limb_t)0;
+} // namespace
+
+Num3072::Num3072()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+Num3072::Num3072(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = 0;
+        for (int j = 0; j < LIMB_SIZE / 8; j++)
+            limbs[i] |= (limb_t)data[i * LIMB_SIZE / 8 + j] << (8 * j);
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; i++)
+        for (int j = 0; j < LIMB_SIZE / 8; j++)
+            out[i * LIMB_SIZE / 8 + j] = limbs[i] >> (8 * j);
+}
+
+/** Whether the value is at least the prime, which only happens below 2^3072 for a handful of values */
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= LIMB_MAX - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; i++)
+        if (limbs[i] != LIMB_MAX)
+            return false;
+    return true;
+}
+
+/** Subtract the prime, i.e. add MAX_PRIME_DIFF and drop the carry out of the top limb */
+void Num3072::FullReduce()
+{
+    limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && carry; i++) {
+        limbs[i] += carry;
+        carry = limbs[i] < carry ? 1 : 0;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook product into 6144 bits
+    limb_t t[2 * LIMBS];
+    for (int i = 0; i < 2 * LIMBS; i++)
+        t[i] = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t cur = (double_limb_t)limbs[i] * a.limbs[j] + t[i + j] + carry;
+            t[i + j] = (limb_t)cur;
+            carry = cur >> LIMB_SIZE;
+        }
+        t[i + LIMBS] = carry;
+    }
+
+    // 2^3072 is congruent to MAX_PRIME_DIFF, so fold the high half onto the low half
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t cur = (double_limb_t)t[i + LIMBS] * MAX_PRIME_DIFF + t[i] + carry;
+        limbs[i] = (limb_t)cur;
+        carry = cur >> LIMB_SIZE;
+    }
+
+    // The carry is below 2^22; fold it the same way, and once more if that wraps
+    while (carry) {
+        double_limb_t cur = (double_limb_t)carry * MAX_PRIME_DIFF;
+        carry = 0;
+        for (int i = 0; i < LIMBS && cur; i++) {
+            cur += limbs[i];
+            limbs[i] = (limb_t)cur;
+            cur >>= LIMB_SIZE;
+        }
+        carry = (limb_t)cur;
+    }
+
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::Invert()
+{
+    // Fermat: a^(p-2), with p-2 = 2^3072 - MAX_PRIME_DIFF - 2
+    Num3072 base = *this;
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        limb_t exp = i == 0 ? (limb_t)(0 - MAX_PRIME_DIFF - 2) : LIMB_MAX;
+        for (int bit = LIMB_SIZE - 1; bit >= 0; bit--) {
+            result.Multiply(result);
+            if ((exp >> bit) & 1)
+                result.Multiply(base);
+        }
+    }
+    *this = result;
+}
+
+/** Map an element to a number: its SHA256 expanded to 3072 bits with SHA512 in counter mode */
+Num3072 CMuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char key[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(key);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(key, sizeof(key)).Write(&i, 1).Finalize(bytes + i * CSHA512::OUTPUT_SIZE);
+    return Num3072(bytes);
+}
+
+CMuHash3072& CMuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+void CMuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 value = denominator;
+    value.Invert();
+    value.Multiply(numerator);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    value.ToBytes(bytes);
+    CSHA256().Write(bytes, sizeof(bytes)).Finalize(hash);
+}
+
+void CMuHash3072::ToBytes(unsigned char out[STATE_SIZE]) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void CMuHash3072::FromBytes(const unsigned char in[STATE_SIZE])
+{
+    numerator = Num3072(in);
+    denominator = Num3072(in + Num3072::BYTE_SIZE);
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** A number modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+    static const int LIMB_SIZE = 64;
+    static const int LIMBS = 48;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+    static const int LIMB_SIZE = 32;
+    static const int LIMBS = 96;
+#endif
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    //! Set to one
+    Num3072();
+    //! Set from BYTE_SIZE little endian bytes, reduced modulo the prime
+    explicit Num3072(const unsigned char data[BYTE_SIZE]);
+
+    void Multiply(const Num3072& a);
+    //! Replace by the multiplicative inverse
+    void Invert();
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/**
+ * Hash of a set of byte strings, updatable one element at a time in any order.
+ *
+ * Every element is mapped to a number modulo a 3072-bit prime and the set is
+ * hashed as the product of its elements. Removal multiplies the denominator,
+ * so that only Finalize() needs a modular inversion. Inserting and removing
+ * the same element is a no-op, and two hashes of disjoint sets combine with
+ * operator*=.
+ */
+class CMuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+    //! Size of the state as written by ToBytes()
+    static const size_t STATE_SIZE = 2 * Num3072::BYTE_SIZE;
+
+    //! Hash of the empty set
+    CMuHash3072() {}
+
+    CMuHash3072& Insert(const unsigned char* data, size_t len);
+    CMuHash3072& Remove(const unsigned char* data, size_t len);
+    CMuHash3072& operator*=(const CMuHash3072& other);
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    void ToBytes(unsigned char out[STATE_SIZE]) const;
+    void FromBytes(const unsigned char in[STATE_SIZE]);
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -0,0 +1,228 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/mktcash-config.h"
+#endif
+
+#include "crypto/quark.h"
+
+#include "crypto/sph_blake.h"
+#include "crypto/sph_bmw.h"
+#include "crypto/sph_groestl.h"
+#include "crypto/sph_jh.h"
+#include "crypto/sph_keccak.h"
+#include "crypto/sph_skein.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <vector>
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+// Runtime-selected implementations, built in their own library with the
+// matching instruction set flags.
+namespace quark_avx2
+{
+void Blake512_4way(unsigned char* out, const unsigned char* in, size_t len);
+void Keccak512_4way(unsigned char* out, const unsigned char* in);
+void Skein512_4way(unsigned char* out, const unsigned char* in);
+}
+
+namespace
+{
+/** Hash blocks independent fixed-length messages into 64-byte digests. */
+typedef void (*QuarkFunc)(unsigned char* out, const unsigned char* in, size_t blocks);
+
+// The sph close functions reset the context, so one context serves a whole batch.
+#define QUARK_SCALAR(name, algo, len)                                             \
+    void name(unsigned char* out, const unsigned char* in, size_t blocks)         \
+    {                                                                             \
+        sph_##algo##_context ctx;                                                 \
+        sph_##algo##_init(&ctx);                                                  \
+        for (size_t i = 0; i < blocks; ++i) {                                     \
+            sph_##algo(&ctx, in + len * i, len);                                  \
+            sph_##algo##_close(&ctx, out + 64 * i);                               \
+        }                                                                         \
+    }
+
+QUARK_SCALAR(Blake512Header, blake512, 80)
+QUARK_SCALAR(Blake512Scalar, blake512, 64)
+QUARK_SCALAR(Bmw512, bmw512, 64)
+QUARK_SCALAR(Groestl512, groestl512, 64)
+QUARK_SCALAR(Jh512, jh512, 64)
+QUARK_SCALAR(Keccak512Scalar, keccak512, 64)
+QUARK_SCALAR(Skein512Scalar, skein512, 64)
+
+#undef QUARK_SCALAR
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+/** Run a 4-way kernel over as many lanes as possible and the scalar code on the rest. */
+template <void (*Kernel)(unsigned char*, const unsigned char*), QuarkFunc Scalar>
+void Batch4(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    while (blocks >= 4) {
+        Kernel(out, in);
+        out += 256;
+        in += 256;
+        blocks -= 4;
+    }
+    if (blocks)
+        Scalar(out, in, blocks);
+}
+
+void Blake512Header_4way(unsigned char* out, const unsigned char* in) { quark_avx2::Blake512_4way(out, in, 80); }
+void Blake512_4way(unsigned char* out, const unsigned char* in) { quark_avx2::Blake512_4way(out, in, 64); }
+
+void Blake512Header_AVX2(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    while (blocks >= 4) {
+        Blake512Header_4way(out, in);
+        out += 256;
+        in += 320;
+        blocks -= 4;
+    }
+    if (blocks)
+        Blake512Header(out, in, blocks);
+}
+#endif
+
+QuarkFunc Blake512_80 = Blake512Header;
+QuarkFunc Blake512 = Blake512Scalar;
+QuarkFunc Keccak512 = Keccak512Scalar;
+QuarkFunc Skein512 = Skein512Scalar;
+
+/** Run one of two functions on each 64-byte lane, chosen by bit 3 of its
+ *  first byte (the low bits of the uint512 as HashQuark tests them). Lanes
+ *  are gathered by outcome so each function sees a contiguous batch.
+ */
+void Branch(unsigned char* out, const unsigned char* in, size_t blocks, QuarkFunc fSet, QuarkFunc fClear, std::vector<unsigned char>& scratch, std::vector<size_t>& order)
+{
+    size_t nSet = 0;
+    order.resize(blocks);
+    for (size_t i = 0; i < blocks; ++i) {
+        if (in[64 * i] & 8)
+            order[nSet++] = i;
+    }
+    size_t nClear = nSet;
+    for (size_t i = 0; i < blocks; ++i) {
+        if (!(in[64 * i] & 8))
+            order[nClear++] = i;
+    }
+    unsigned char* gathered = &scratch[0];
+    unsigned char* hashed = &scratch[64 * blocks];
+    for (size_t i = 0; i < blocks; ++i)
+        memcpy(gathered + 64 * i, in + 64 * order[i], 64);
+    if (nSet)
+        fSet(hashed, gathered, nSet);
+    if (blocks > nSet)
+        fClear(hashed + 64 * nSet, gathered + 64 * nSet, blocks - nSet);
+    for (size_t i = 0; i < blocks; ++i)
+        memcpy(out + 64 * order[i], hashed + 64 * i, 64);
+}
+
+bool SelfTest()
+{
+    unsigned char in[8 * 80];
+    unsigned char out1[8 * 64], out2[8 * 64];
+    for (size_t i = 0; i < sizeof(in); ++i)
+        in[i] = (unsigned char)(i * 7 + 1);
+
+    Blake512Header(out1, in, 8);
+    Blake512_80(out2, in, 8);
+    if (memcmp(out1, out2, sizeof(out1)))
+        return false;
+    Blake512Scalar(out1, in, 8);
+    Blake512(out2, in, 8);
+    if (memcmp(out1, out2, sizeof(out1)))
+        return false;
+    Keccak512Scalar(out1, in, 8);
+    Keccak512(out2, in, 8);
+    if (memcmp(out1, out2, sizeof(out1)))
+        return false;
+    Skein512Scalar(out1, in, 8);
+    Skein512(out2, in, 8);
+    if (memcmp(out1, out2, sizeof(out1)))
+        return false;
+    return true;
+}
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+/** Check whether the OS has enabled AVX registers. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv"
+            : "=a"(a), "=d"(d)
+            : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+} // namespace
+
+std::string QuarkAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    bool have_avx = false;
+    bool have_avx2 = false;
+    uint32_t eax, ebx, ecx, edx;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    have_avx = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabled();
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+    }
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && have_avx) {
+        Blake512_80 = Blake512Header_AVX2;
+        Blake512 = Batch4<Blake512_4way, Blake512Scalar>;
+        Keccak512 = Batch4<quark_avx2::Keccak512_4way, Keccak512Scalar>;
+        Skein512 = Batch4<quark_avx2::Skein512_4way, Skein512Scalar>;
+        ret = "avx2(4way blake512,keccak512,skein512)";
+    }
+#endif
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+void HashQuark80(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    // Bound the working set; each lane needs two 64-byte state buffers plus
+    // scratch space for branch gathering.
+    static const size_t MAX_BATCH = 256;
+    const size_t nBatch = std::min(blocks, MAX_BATCH);
+    std::vector<unsigned char> a(64 * nBatch), b(64 * nBatch), scratch(128 * nBatch);
+    std::vector<size_t> order;
+
+    while (blocks) {
+        const size_t n = std::min(blocks, MAX_BATCH);
+        unsigned char* pa = &a[0];
+        unsigned char* pb = &b[0];
+
+        Blake512_80(pa, input, n);
+        Bmw512(pb, pa, n);
+        Branch(pa, pb, n, Groestl512, Skein512, scratch, order);
+        Groestl512(pb, pa, n);
+        Jh512(pa, pb, n);
+        Branch(pb, pa, n, Blake512, Bmw512, scratch, order);
+        Keccak512(pa, pb, n);
+        Skein512(pb, pa, n);
+        Branch(pa, pb, n, Keccak512, Jh512, scratch, order);
+
+        for (size_t i = 0; i < n; ++i)
+            memcpy(output + 32 * i, pa + 64 * i, 32);
+
+        output += 32 * n;
+        input += 80 * n;
+        blocks -= n;
+    }
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_QUARK_H
+#define BITCOIN_CRYPTO_QUARK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** Autodetect SIMD implementations of the Quark primitives and self-test
+ *  them. Returns a description of the selected ones.
+ */
+std::string QuarkAutoDetect();
+
+/** Compute the Quark hashes of multiple 80-byte legacy block headers.
+ *  Equivalent to HashQuark() over each header, but runs every stage over
+ *  the whole batch, with lanes grouped by branch outcome.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*80 byte input buffer
+ *  blocks:  the number of headers to hash.
+ */
+void HashQuark80(unsigned char* output, const unsigned char* input, size_t blocks);
+
+#endif // BITCOIN_CRYPTO_QUARK_H
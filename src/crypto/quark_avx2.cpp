@@ -0,0 +1,346 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 4-way AVX2 implementations of the Quark primitives that operate on 64-bit
+// add/rotate/xor words: BLAKE-512, Keccak-512 and Skein-512. Each hashes four
+// independent single-block messages, one per 64-bit lane.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace quark_avx2
+{
+namespace
+{
+__m256i inline K(uint64_t x) { return _mm256_set1_epi64x(x); }
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi64(x, y); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline AndNot(__m256i x, __m256i y) { return _mm256_andnot_si256(x, y); }
+__m256i inline RotL(__m256i x, int n) { return _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - n)); }
+__m256i inline RotR(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n)); }
+
+/** Load word i of four lanes stored back to back in a [4][words] array. */
+__m256i inline Load(const uint64_t (*w)[16], int i)
+{
+    return _mm256_set_epi64x(w[3][i], w[2][i], w[1][i], w[0][i]);
+}
+
+void inline Store(uint64_t (*w)[8], int i, __m256i v)
+{
+    uint64_t tmp[4];
+    _mm256_storeu_si256((__m256i*)tmp, v);
+    w[0][i] = tmp[0];
+    w[1][i] = tmp[1];
+    w[2][i] = tmp[2];
+    w[3][i] = tmp[3];
+}
+
+////// BLAKE-512
+
+const uint64_t blake_iv[8] = {
+    0x6A09E667F3BCC908ull, 0xBB67AE8584CAA73Bull, 0x3C6EF372FE94F82Bull, 0xA54FF53A5F1D36F1ull,
+    0x510E527FADE682D1ull, 0x9B05688C2B3E6C1Full, 0x1F83D9ABFB41BD6Bull, 0x5BE0CD19137E2179ull};
+
+const uint64_t blake_c[16] = {
+    0x243F6A8885A308D3ull, 0x13198A2E03707344ull, 0xA4093822299F31D0ull, 0x082EFA98EC4E6C89ull,
+    0x452821E638D01377ull, 0xBE5466CF34E90C6Cull, 0xC0AC29B7C97C50DDull, 0x3F84D5B5B5470917ull,
+    0x9216D5D98979FB1Bull, 0xD1310BA698DFB5ACull, 0x2FFD72DBD01ADFB7ull, 0xB8E1AFED6A267E96ull,
+    0xBA7C9045F12C7F99ull, 0x24A19947B3916CF7ull, 0x0801F2E2858EFC16ull, 0x636920D871574E69ull};
+
+const unsigned char blake_sigma[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0}};
+
+void inline BlakeG(const __m256i* m, const unsigned char* s, int i, __m256i& a, __m256i& b, __m256i& c, __m256i& d)
+{
+    a = Add(Add(a, b), Xor(m[s[2 * i]], K(blake_c[s[2 * i + 1]])));
+    d = RotR(Xor(d, a), 32);
+    c = Add(c, d);
+    b = RotR(Xor(b, c), 25);
+    a = Add(Add(a, b), Xor(m[s[2 * i + 1]], K(blake_c[s[2 * i]])));
+    d = RotR(Xor(d, a), 16);
+    c = Add(c, d);
+    b = RotR(Xor(b, c), 11);
+}
+
+////// Keccak-512
+
+const uint64_t keccak_rc[24] = {
+    0x0000000000000001ull, 0x0000000000008082ull, 0x800000000000808Aull, 0x8000000080008000ull,
+    0x000000000000808Bull, 0x0000000080000001ull, 0x8000000080008081ull, 0x8000000000008009ull,
+    0x000000000000008Aull, 0x0000000000000088ull, 0x0000000080008009ull, 0x000000008000000Aull,
+    0x000000008000808Bull, 0x800000000000008Bull, 0x8000000000008089ull, 0x8000000000008003ull,
+    0x8000000000008002ull, 0x8000000000000080ull, 0x000000000000800Aull, 0x800000008000000Aull,
+    0x8000000080008081ull, 0x8000000000008080ull, 0x0000000080000001ull, 0x8000000080008008ull};
+
+////// Skein-512
+
+const uint64_t skein_iv[8] = {
+    0x4903ADFF749C51CEull, 0x0D95DE399746DF03ull, 0x8FD1934127C79BCEull, 0x9A255629FF352CB1ull,
+    0x5DB62599DF6CA7B0ull, 0xEABE394CA9D5C3F4ull, 0x991112C71A75B523ull, 0xAE18A40B660FCC33ull};
+
+#define SKEIN_MIX(x0, x1, rc)       \
+    do {                            \
+        x0 = Add(x0, x1);           \
+        x1 = Xor(RotL(x1, rc), x0); \
+    } while (0)
+
+#define SKEIN_MIX8(w0, w1, w2, w3, w4, w5, w6, w7, rc0, rc1, rc2, rc3) \
+    do {                                                               \
+        SKEIN_MIX(w0, w1, rc0);                                        \
+        SKEIN_MIX(w2, w3, rc1);                                        \
+        SKEIN_MIX(w4, w5, rc2);                                        \
+        SKEIN_MIX(w6, w7, rc3);                                        \
+    } while (0)
+
+#define SKEIN_INJECT(s)                                               \
+    do {                                                              \
+        p0 = Add(p0, k[(s) % 9]);                                     \
+        p1 = Add(p1, k[((s) + 1) % 9]);                               \
+        p2 = Add(p2, k[((s) + 2) % 9]);                               \
+        p3 = Add(p3, k[((s) + 3) % 9]);                               \
+        p4 = Add(p4, k[((s) + 4) % 9]);                               \
+        p5 = Add(p5, Add(k[((s) + 5) % 9], K(t[(s) % 3])));           \
+        p6 = Add(p6, Add(k[((s) + 6) % 9], K(t[((s) + 1) % 3])));     \
+        p7 = Add(p7, Add(k[((s) + 7) % 9], K(s)));                    \
+    } while (0)
+
+/** One UBI block: h = Threefish-512(key h, tweak t0:t1, m) ^ m. */
+void SkeinUBI(__m256i* h, const __m256i* m, uint64_t t0, uint64_t t1)
+{
+    const uint64_t t[3] = {t0, t1, t0 ^ t1};
+    __m256i k[9];
+    k[8] = K(0x1BD11BDAA9FC1A22ull);
+    for (int i = 0; i < 8; i++) {
+        k[i] = h[i];
+        k[8] = Xor(k[8], h[i]);
+    }
+    __m256i p0 = m[0], p1 = m[1], p2 = m[2], p3 = m[3], p4 = m[4], p5 = m[5], p6 = m[6], p7 = m[7];
+    for (int s = 0; s < 18; s += 2) {
+        SKEIN_INJECT(s);
+        SKEIN_MIX8(p0, p1, p2, p3, p4, p5, p6, p7, 46, 36, 19, 37);
+        SKEIN_MIX8(p2, p1, p4, p7, p6, p5, p0, p3, 33, 27, 14, 42);
+        SKEIN_MIX8(p4, p1, p6, p3, p0, p5, p2, p7, 17, 49, 36, 39);
+        SKEIN_MIX8(p6, p1, p0, p7, p2, p5, p4, p3, 44, 9, 54, 56);
+        SKEIN_INJECT(s + 1);
+        SKEIN_MIX8(p0, p1, p2, p3, p4, p5, p6, p7, 39, 30, 34, 24);
+        SKEIN_MIX8(p2, p1, p4, p7, p6, p5, p0, p3, 13, 50, 10, 17);
+        SKEIN_MIX8(p4, p1, p6, p3, p0, p5, p2, p7, 25, 29, 39, 43);
+        SKEIN_MIX8(p6, p1, p0, p7, p2, p5, p4, p3, 8, 35, 56, 22);
+    }
+    SKEIN_INJECT(18);
+    h[0] = Xor(p0, m[0]);
+    h[1] = Xor(p1, m[1]);
+    h[2] = Xor(p2, m[2]);
+    h[3] = Xor(p3, m[3]);
+    h[4] = Xor(p4, m[4]);
+    h[5] = Xor(p5, m[5]);
+    h[6] = Xor(p6, m[6]);
+    h[7] = Xor(p7, m[7]);
+}
+
+#undef SKEIN_INJECT
+#undef SKEIN_MIX8
+#undef SKEIN_MIX
+
+} // namespace
+
+void Blake512_4way(unsigned char* out, const unsigned char* in, size_t len)
+{
+    // Single padded 128-byte block per lane: message, 0x80, zeros, the
+    // "512-bit output" marker bit, and the 128-bit big-endian bit length.
+    uint64_t w[4][16];
+    for (int l = 0; l < 4; l++) {
+        unsigned char block[128];
+        memcpy(block, in + l * len, len);
+        memset(block + len, 0, 128 - len);
+        block[len] = 0x80;
+        block[111] |= 1;
+        WriteBE64(block + 120, len * 8);
+        for (int i = 0; i < 16; i++)
+            w[l][i] = ReadBE64(block + 8 * i);
+    }
+
+    __m256i m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = Load(w, i);
+
+    const uint64_t t0 = len * 8;
+    __m256i v0 = K(blake_iv[0]), v1 = K(blake_iv[1]), v2 = K(blake_iv[2]), v3 = K(blake_iv[3]);
+    __m256i v4 = K(blake_iv[4]), v5 = K(blake_iv[5]), v6 = K(blake_iv[6]), v7 = K(blake_iv[7]);
+    __m256i v8 = K(blake_c[0]), v9 = K(blake_c[1]), va = K(blake_c[2]), vb = K(blake_c[3]);
+    __m256i vc = K(t0 ^ blake_c[4]), vd = K(t0 ^ blake_c[5]), ve = K(blake_c[6]), vf = K(blake_c[7]);
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = blake_sigma[r % 10];
+        BlakeG(m, s, 0, v0, v4, v8, vc);
+        BlakeG(m, s, 1, v1, v5, v9, vd);
+        BlakeG(m, s, 2, v2, v6, va, ve);
+        BlakeG(m, s, 3, v3, v7, vb, vf);
+        BlakeG(m, s, 4, v0, v5, va, vf);
+        BlakeG(m, s, 5, v1, v6, vb, vc);
+        BlakeG(m, s, 6, v2, v7, v8, vd);
+        BlakeG(m, s, 7, v3, v4, v9, ve);
+    }
+
+    uint64_t h[4][8];
+    Store(h, 0, Xor(K(blake_iv[0]), Xor(v0, v8)));
+    Store(h, 1, Xor(K(blake_iv[1]), Xor(v1, v9)));
+    Store(h, 2, Xor(K(blake_iv[2]), Xor(v2, va)));
+    Store(h, 3, Xor(K(blake_iv[3]), Xor(v3, vb)));
+    Store(h, 4, Xor(K(blake_iv[4]), Xor(v4, vc)));
+    Store(h, 5, Xor(K(blake_iv[5]), Xor(v5, vd)));
+    Store(h, 6, Xor(K(blake_iv[6]), Xor(v6, ve)));
+    Store(h, 7, Xor(K(blake_iv[7]), Xor(v7, vf)));
+    for (int l = 0; l < 4; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE64(out + 64 * l + 8 * i, h[l][i]);
+}
+
+void Keccak512_4way(unsigned char* out, const unsigned char* in)
+{
+    // The 64-byte message and its padding fit in the 72-byte rate, so the
+    // sponge absorbs exactly one block.
+    uint64_t w[4][16];
+    for (int l = 0; l < 4; l++)
+        for (int i = 0; i < 8; i++)
+            w[l][i] = ReadLE64(in + 64 * l + 8 * i);
+
+    __m256i a00 = Load(w, 0), a01 = Load(w, 1), a02 = Load(w, 2), a03 = Load(w, 3), a04 = Load(w, 4);
+    __m256i a05 = Load(w, 5), a06 = Load(w, 6), a07 = Load(w, 7), a08 = K(0x8000000000000001ull), a09 = _mm256_setzero_si256();
+    __m256i a10 = a09, a11 = a09, a12 = a09, a13 = a09, a14 = a09;
+    __m256i a15 = a09, a16 = a09, a17 = a09, a18 = a09, a19 = a09;
+    __m256i a20 = a09, a21 = a09, a22 = a09, a23 = a09, a24 = a09;
+    __m256i b00, b01, b02, b03, b04, b05, b06, b07, b08, b09, b10, b11, b12;
+    __m256i b13, b14, b15, b16, b17, b18, b19, b20, b21, b22, b23, b24;
+    __m256i c0, c1, c2, c3, c4, d;
+
+    for (int r = 0; r < 24; r++) {
+        // theta
+        c0 = Xor(Xor(Xor(a00, a05), Xor(a10, a15)), a20);
+        c1 = Xor(Xor(Xor(a01, a06), Xor(a11, a16)), a21);
+        c2 = Xor(Xor(Xor(a02, a07), Xor(a12, a17)), a22);
+        c3 = Xor(Xor(Xor(a03, a08), Xor(a13, a18)), a23);
+        c4 = Xor(Xor(Xor(a04, a09), Xor(a14, a19)), a24);
+        d = Xor(c4, RotL(c1, 1));
+        a00 = Xor(a00, d); a05 = Xor(a05, d); a10 = Xor(a10, d); a15 = Xor(a15, d); a20 = Xor(a20, d);
+        d = Xor(c0, RotL(c2, 1));
+        a01 = Xor(a01, d); a06 = Xor(a06, d); a11 = Xor(a11, d); a16 = Xor(a16, d); a21 = Xor(a21, d);
+        d = Xor(c1, RotL(c3, 1));
+        a02 = Xor(a02, d); a07 = Xor(a07, d); a12 = Xor(a12, d); a17 = Xor(a17, d); a22 = Xor(a22, d);
+        d = Xor(c2, RotL(c4, 1));
+        a03 = Xor(a03, d); a08 = Xor(a08, d); a13 = Xor(a13, d); a18 = Xor(a18, d); a23 = Xor(a23, d);
+        d = Xor(c3, RotL(c0, 1));
+        a04 = Xor(a04, d); a09 = Xor(a09, d); a14 = Xor(a14, d); a19 = Xor(a19, d); a24 = Xor(a24, d);
+        // rho and pi
+        b00 = a00;
+        b01 = RotL(a06, 44);
+        b02 = RotL(a12, 43);
+        b03 = RotL(a18, 21);
+        b04 = RotL(a24, 14);
+        b05 = RotL(a03, 28);
+        b06 = RotL(a09, 20);
+        b07 = RotL(a10, 3);
+        b08 = RotL(a16, 45);
+        b09 = RotL(a22, 61);
+        b10 = RotL(a01, 1);
+        b11 = RotL(a07, 6);
+        b12 = RotL(a13, 25);
+        b13 = RotL(a19, 8);
+        b14 = RotL(a20, 18);
+        b15 = RotL(a04, 27);
+        b16 = RotL(a05, 36);
+        b17 = RotL(a11, 10);
+        b18 = RotL(a17, 15);
+        b19 = RotL(a23, 56);
+        b20 = RotL(a02, 62);
+        b21 = RotL(a08, 55);
+        b22 = RotL(a14, 39);
+        b23 = RotL(a15, 41);
+        b24 = RotL(a21, 2);
+        // chi and iota
+        a00 = Xor(b00, AndNot(b01, b02));
+        a01 = Xor(b01, AndNot(b02, b03));
+        a02 = Xor(b02, AndNot(b03, b04));
+        a03 = Xor(b03, AndNot(b04, b00));
+        a04 = Xor(b04, AndNot(b00, b01));
+        a05 = Xor(b05, AndNot(b06, b07));
+        a06 = Xor(b06, AndNot(b07, b08));
+        a07 = Xor(b07, AndNot(b08, b09));
+        a08 = Xor(b08, AndNot(b09, b05));
+        a09 = Xor(b09, AndNot(b05, b06));
+        a10 = Xor(b10, AndNot(b11, b12));
+        a11 = Xor(b11, AndNot(b12, b13));
+        a12 = Xor(b12, AndNot(b13, b14));
+        a13 = Xor(b13, AndNot(b14, b10));
+        a14 = Xor(b14, AndNot(b10, b11));
+        a15 = Xor(b15, AndNot(b16, b17));
+        a16 = Xor(b16, AndNot(b17, b18));
+        a17 = Xor(b17, AndNot(b18, b19));
+        a18 = Xor(b18, AndNot(b19, b15));
+        a19 = Xor(b19, AndNot(b15, b16));
+        a20 = Xor(b20, AndNot(b21, b22));
+        a21 = Xor(b21, AndNot(b22, b23));
+        a22 = Xor(b22, AndNot(b23, b24));
+        a23 = Xor(b23, AndNot(b24, b20));
+        a24 = Xor(b24, AndNot(b20, b21));
+        a00 = Xor(a00, K(keccak_rc[r]));
+    }
+
+    uint64_t h[4][8];
+    Store(h, 0, a00);
+    Store(h, 1, a01);
+    Store(h, 2, a02);
+    Store(h, 3, a03);
+    Store(h, 4, a04);
+    Store(h, 5, a05);
+    Store(h, 6, a06);
+    Store(h, 7, a07);
+    for (int l = 0; l < 4; l++)
+        for (int i = 0; i < 8; i++)
+            WriteLE64(out + 64 * l + 8 * i, h[l][i]);
+}
+
+void Skein512_4way(unsigned char* out, const unsigned char* in)
+{
+    uint64_t w[4][16];
+    for (int l = 0; l < 4; l++)
+        for (int i = 0; i < 8; i++)
+            w[l][i] = ReadLE64(in + 64 * l + 8 * i);
+
+    __m256i h[8], m[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = K(skein_iv[i]);
+        m[i] = Load(w, i);
+    }
+    // Message block (first + final, type 48), then the output block
+    // (first + final, type 63) over a zero counter.
+    SkeinUBI(h, m, 64, 0xF0ull << 56);
+    for (int i = 0; i < 8; i++)
+        m[i] = _mm256_setzero_si256();
+    SkeinUBI(h, m, 8, 0xFFull << 56);
+
+    uint64_t o[4][8];
+    for (int i = 0; i < 8; i++)
+        Store(o, i, h[i]);
+    for (int l = 0; l < 4; l++)
+        for (int i = 0; i < 8; i++)
+            WriteLE64(out + 64 * l + 8 * i, o[l][i]);
+}
+} // namespace quark_avx2
+
+#endif
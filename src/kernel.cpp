@@ -6,6 +6,7 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -39,17 +40,98 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
     return nIntervalEnd - nIntervalBeginning - nStakeMinAge;
 }
 
+// Modifier-generating blocks of the chain ending at pindexStakeModifierTip, in
+// height order. Kernel and last-modifier lookups binary search this instead of
+// walking the chain, and a reorg only truncates its tail.
+struct CStakeModifierEntry {
+    const CBlockIndex* pindex;
+    int nHeight;
+    int64_t nTime;
+    int64_t nTimeMax; // highest block time of this and all earlier entries
+    uint64_t nStakeModifier;
+};
+
+struct CompareStakeModifierHeight {
+    bool operator()(int nHeight, const CStakeModifierEntry& entry) const { return nHeight < entry.nHeight; }
+};
+
+struct CompareStakeModifierTimeMax {
+    bool operator()(const CStakeModifierEntry& entry, int64_t nTime) const { return entry.nTimeMax < nTime; }
+};
+
+static CCriticalSection cs_stakeModifierIndex;
+static std::vector<CStakeModifierEntry> vStakeModifierIndex;
+static const CBlockIndex* pindexStakeModifierTip = NULL;
+
+void UpdateStakeModifierIndex(const CBlockIndex* pindexTip)
+{
+    LOCK(cs_stakeModifierIndex);
+    pindexStakeModifierTip = pindexTip;
+    if (!pindexTip) {
+        vStakeModifierIndex.clear();
+        return;
+    }
+
+    // Drop the entries that are no longer ancestors of the new tip
+    while (!vStakeModifierIndex.empty()) {
+        const CStakeModifierEntry& entry = vStakeModifierIndex.back();
+        if (entry.nHeight <= pindexTip->nHeight && pindexTip->GetAncestor(entry.nHeight) == entry.pindex)
+            break;
+        vStakeModifierIndex.pop_back();
+    }
+
+    // Append the generating blocks above the last remaining entry
+    int nHeightLast = vStakeModifierIndex.empty() ? -1 : vStakeModifierIndex.back().nHeight;
+    std::vector<const CBlockIndex*> vNew;
+    for (const CBlockIndex* pindex = pindexTip; pindex && pindex->nHeight > nHeightLast; pindex = pindex->pprev) {
+        if (pindex->GeneratedStakeModifier())
+            vNew.push_back(pindex);
+    }
+
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vNew.rbegin(); it != vNew.rend(); ++it) {
+        CStakeModifierEntry entry;
+        entry.pindex = *it;
+        entry.nHeight = (*it)->nHeight;
+        entry.nTime = (*it)->GetBlockTime();
+        entry.nTimeMax = vStakeModifierIndex.empty() ? entry.nTime : std::max(vStakeModifierIndex.back().nTimeMax, entry.nTime);
+        entry.nStakeModifier = (*it)->nStakeModifier;
+        vStakeModifierIndex.push_back(entry);
+    }
+}
+
+// Position of the first indexed entry above nHeight
+static size_t StakeModifierIndexAbove(int nHeight)
+{
+    return std::upper_bound(vStakeModifierIndex.begin(), vStakeModifierIndex.end(), nHeight, CompareStakeModifierHeight()) - vStakeModifierIndex.begin();
+}
+
+static bool IsOnStakeModifierIndex(const CBlockIndex* pindex)
+{
+    return pindexStakeModifierTip && pindex->nHeight <= pindexStakeModifierTip->nHeight &&
+           pindexStakeModifierTip->GetAncestor(pindex->nHeight) == pindex;
+}
+
 // Get the last stake modifier and its generation time from a given block
 static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
 
-    while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
+    LOCK(cs_stakeModifierIndex);
+    // Blocks off the indexed chain (e.g. a fork being accepted) are walked
+    // until they either generated a modifier or join the indexed chain
+    while (pindex->pprev && !pindex->GeneratedStakeModifier() && !IsOnStakeModifierIndex(pindex))
         pindex = pindex->pprev;
 
-    if (!pindex->GeneratedStakeModifier())
-        return error("GetLastStakeModifier: no generation at genesis block");
+    if (!pindex->GeneratedStakeModifier()) {
+        size_t n = IsOnStakeModifierIndex(pindex) ? StakeModifierIndexAbove(pindex->nHeight) : 0;
+        if (n == 0)
+            return error("GetLastStakeModifier: no generation at genesis block");
+
+        nStakeModifier = vStakeModifierIndex[n - 1].nStakeModifier;
+        nModifierTime = vStakeModifierIndex[n - 1].nTime;
+        return true;
+    }
 
     nStakeModifier = pindex->nStakeModifier;
     nModifierTime = pindex->GetBlockTime();
@@ -67,7 +149,7 @@ static int64_t GetStakeModifierSelectionIntervalSection(int nSection)
 }
 
 // Get stake modifier selection interval (in seconds)
-static int64_t GetStakeModifierSelectionInterval()
+int64_t GetStakeModifierSelectionInterval()
 {
     int64_t nSelectionInterval = 0;
     for (int nSection = 0; nSection < 64; nSection++) {
@@ -259,28 +341,38 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
 
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    return GetKernelStakeModifier(mapBlockIndex[hashBlockFrom], nStakeModifier, nStakeModifierHeight, nStakeModifierTime);
+}
+
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
+{
+    nStakeModifier = 0;
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
-    int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
-    CBlockIndex* pindexNext = chainActive[pindexFrom->nHeight + 1];
-
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval) {
-        if (!pindexNext) {
-            // Should never happen
-            return error("Null pindexNext\n");
-        }
+    int64_t nTimeTarget = pindexFrom->GetBlockTime() + GetStakeModifierSelectionInterval();
+
+    // Find the first modifier generated above the coin's block at least a
+    // selection interval after it
+    LOCK(cs_stakeModifierIndex);
+    size_t nFirst = StakeModifierIndexAbove(pindexFrom->nHeight);
+    size_t n = nFirst;
+    if (nFirst == 0 || vStakeModifierIndex[nFirst - 1].nTimeMax < nTimeTarget) {
+        n = std::lower_bound(vStakeModifierIndex.begin() + nFirst, vStakeModifierIndex.end(), nTimeTarget, CompareStakeModifierTimeMax()) - vStakeModifierIndex.begin();
+    } else {
+        // An earlier block is timestamped past the target, so the running
+        // maximum says nothing about this range
+        while (n < vStakeModifierIndex.size() && vStakeModifierIndex[n].nTime < nTimeTarget)
+            n++;
+    }
 
-        pindex = pindexNext;
-        pindexNext = chainActive[pindexNext->nHeight + 1];
-        if (pindex->GeneratedStakeModifier()) {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
+    if (n == vStakeModifierIndex.size()) {
+        // Should never happen
+        return error("Null pindexNext\n");
     }
-    nStakeModifier = pindex->nStakeModifier;
+
+    nStakeModifier = vStakeModifierIndex[n].nStakeModifier;
+    nStakeModifierHeight = vStakeModifierIndex[n].nHeight;
+    nStakeModifierTime = vStakeModifierIndex[n].nTime;
 
     return true;
 }
@@ -295,6 +387,21 @@ bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTarget
     return hashProofOfStake < (bnCoinDayWeight * bnTargetPerCoinDay);
 }
 
+CStakeKernelPreimage::CStakeKernelPreimage(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID)
+{
+    assert(ssUniqueID.size() == STAKE_UNIQUENESS_SIZE);
+    WriteLE64(&vch[0], nStakeModifier);
+    WriteLE32(&vch[8], nTimeBlockFrom);
+    memcpy(&vch[12], &ssUniqueID[0], STAKE_UNIQUENESS_SIZE);
+    WriteLE32(&vch[12 + STAKE_UNIQUENESS_SIZE], 0);
+}
+
+uint256 CStakeKernelPreimage::GetHash(unsigned int nTimeTx)
+{
+    WriteLE32(&vch[12 + STAKE_UNIQUENESS_SIZE], nTimeTx);
+    return Hash(BEGIN(vch), END(vch));
+}
+
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget,
                 unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
@@ -305,7 +412,25 @@ bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t
     return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
 }
 
+bool CheckStake(CStakeKernelPreimage& preimage, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    hashProofOfStake = preimage.GetHash(nTimeTx);
+
+    return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
+}
+
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    // Grab stake modifier
+    uint64_t nStakeModifier = 0;
+    if (!stakeInput->GetModifier(nStakeModifier))
+        return error("failed to get kernel stake modifier");
+
+    CStakeKernelPreimage preimage(nStakeModifier, nTimeBlockFrom, stakeInput->GetUniqueness());
+    return Stake(preimage, stakeInput->GetValue(), nBits, nTimeBlockFrom, nTimeTx, hashProofOfStake);
+}
+
+bool Stake(CStakeKernelPreimage& preimage, CAmount nValueIn, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
     if (nTimeTx < nTimeBlockFrom)
         return error("CheckStakeKernelHash() : nTime violation");
@@ -318,18 +443,11 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
-    // Grab stake modifier
-    uint64_t nStakeModifier = 0;
-    if (!stakeInput->GetModifier(nStakeModifier))
-        return error("failed to get kernel stake modifier");
-
     bool fSuccess = false;
     unsigned int nTryTime = 0;
     int nHeightStart = chainActive.Height();
-    int nHashDrift = 30;
+    int nHashDrift = STAKE_HASH_DRIFT;
 
-    CDataStream ssUniqueID = stakeInput->GetUniqueness();
-    CAmount nValueIn = stakeInput->GetValue();
     for (int i = 0; i < nHashDrift; i++) //iterate the hashing
     {
         // New block came in, move on
@@ -340,7 +458,7 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
         nTryTime = nTimeTx + nHashDrift - i;
 
         // If stake hash does not meet the target then continue to next iteration
-        if (!CheckStake(ssUniqueID, nValueIn, nStakeModifier, bnTargetPerCoinDay, nTimeBlockFrom, nTryTime, hashProofOfStake))
+        if (!CheckStake(preimage, nValueIn, bnTargetPerCoinDay, nTryTime, hashProofOfStake))
             continue;
 
         fSuccess = true; // If we make it this far then we have successfully created a stake hash
@@ -355,6 +473,52 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     return fSuccess;
 }
 
+bool StakeHashDrift(CStakeKernelPreimage& preimage, CAmount nValueIn, const uint256& bnTargetPerCoinDay, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    // Candidates are filtered for age before they are handed out, so just skip violations quietly here
+    if (nTimeTx < nTimeBlockFrom || nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+
+    for (int i = 0; i < STAKE_HASH_DRIFT; i++) {
+        unsigned int nTryTime = nTimeTx + STAKE_HASH_DRIFT - i;
+        if (CheckStake(preimage, nValueIn, bnTargetPerCoinDay, nTryTime, hashProofOfStake)) {
+            nTimeTx = nTryTime;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Resolve the output spent by a coinstake kernel and the block it was confirmed in.
+// While the output is unspent in the active chain both come from the coins view and
+// the block index; only outputs already spent there fall back to reading the tx.
+static bool GetKernelPrevout(const COutPoint& prevout, CTxOut& txOut, CBlockIndex*& pindexFrom)
+{
+    LOCK(cs_main);
+
+    const Coin& coin = pcoinsTip->AccessCoin(prevout);
+    if (!coin.IsSpent() && coin.nHeight > 0 && coin.nHeight <= chainActive.Height()) {
+        txOut = coin.out;
+        pindexFrom = chainActive[coin.nHeight];
+        return true;
+    }
+
+    // With -txindex this is a positional read of the tx at its CDiskTxPos
+    uint256 hashBlock;
+    CTransaction txPrev;
+    if (!GetTransaction(prevout.hash, txPrev, hashBlock, true) || prevout.n >= txPrev.vout.size())
+        return error("%s : INFO: read txPrev failed", __func__);
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+        return error("%s: Failed to find the block index", __func__);
+
+    txOut = txPrev.vout[prevout.n];
+    pindexFrom = mi->second;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::unique_ptr<CStakeInput>& stake)
 {
@@ -365,30 +529,20 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::uniqu
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // Construct the stakeinput object
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+    // Construct the stakeinput object from the spent output, no block data needed
+    CTxOut txOutPrev;
+    CBlockIndex* pindex = NULL;
+    if (!GetKernelPrevout(txin.prevout, txOutPrev, pindex))
         return error("CheckProofOfStake() : INFO: read txPrev failed");
 
     // Verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, txOutPrev.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
     CMCHStake* mktcashInput = new CMCHStake();
-    mktcashInput->SetInput(txPrev, txin.prevout.n);
+    mktcashInput->SetInput(txin.prevout, txOutPrev, pindex);
     stake = std::unique_ptr<CStakeInput>(mktcashInput);
 
-    CBlockIndex* pindex = stake->GetIndexFrom();
-    if (!pindex)
-        return error("%s: Failed to find the block index", __func__);
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(block.nBits);
 
@@ -396,7 +550,7 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::uniqu
     if (!stake->GetModifier(nStakeModifier))
         return error("%s failed to get modifier for stake input\n", __func__);
 
-    unsigned int nBlockFromTime = blockprev.nTime;
+    unsigned int nBlockFromTime = pindex->nTime;
     unsigned int nTxTime = block.nTime;
     if (!CheckStake(stake->GetUniqueness(), stake->GetValue(), nStakeModifier, bnTargetPerCoinDay, nBlockFromTime,
                     nTxTime, hashProofOfStake)) {
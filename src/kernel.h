@@ -20,13 +20,50 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Time span after a coin's block from which its kernel stake modifier is taken
+int64_t GetStakeModifierSelectionInterval();
+
 // Compute the hash modifier for proof-of-stake
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime);
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Sync the index of modifier-generating blocks with a new chain tip (NULL clears it)
+void UpdateStakeModifierIndex(const CBlockIndex* pindexTip);
+
+// Number of timestamps tried per stake input and kernel search
+static const int STAKE_HASH_DRIFT = 30;
+
+// Size of the uniqueness bytes of a MCH stake input (vout index + txid)
+static const unsigned int STAKE_UNIQUENESS_SIZE = 4 + 32;
+
+/**
+ * Fixed-layout kernel hash preimage:
+ *   nStakeModifier (8) | nTimeBlockFrom (4) | uniqueness (36) | nTimeTx (4)
+ * Byte-identical to the stream hashed by CheckStake(), but built once per
+ * stake candidate so each hash-drift attempt only rewrites the trailing time.
+ */
+class CStakeKernelPreimage
+{
+public:
+    static const unsigned int SIZE = 8 + 4 + STAKE_UNIQUENESS_SIZE + 4;
+
+    CStakeKernelPreimage() { memset(vch, 0, sizeof(vch)); }
+    CStakeKernelPreimage(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID);
+
+    uint256 GetHash(unsigned int nTimeTx);
+
+private:
+    unsigned char vch[SIZE];
+};
+
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
+bool CheckStake(CStakeKernelPreimage& preimage, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
+bool Stake(CStakeKernelPreimage& preimage, CAmount nValueIn, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
+// Hash-drift loop of Stake() without any chain access, safe to call from kernel search threads
+bool StakeHashDrift(CStakeKernelPreimage& preimage, CAmount nValueIn, const uint256& bnTargetPerCoinDay, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -9,6 +9,7 @@
 #include "main.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockfilter.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -63,13 +64,21 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fAddressIndex = DEFAULT_ADDRESSINDEX;
+bool fSpentIndex = DEFAULT_SPENTINDEX;
+bool fBlockFilterIndex = DEFAULT_BLOCKFILTERINDEX;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fBackgroundFlush = false;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -175,6 +184,9 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Set when more block or undo file space was allocated in prune mode, so FlushStateToDisk looks for files to delete. */
+bool fCheckForPruning = false;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -445,7 +457,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
@@ -524,9 +536,29 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewFlushQueue* pcoinsFlushQueue = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
+/** Running statistics of the UTXO set in pcoinsTip, null until seeded by a scan (protected by cs_main) */
+static CCoinsStats coinsStatsTip;
+
+bool GetTipCoinsStats(CCoinsStats& stats)
+{
+    LOCK(cs_main);
+    if (coinsStatsTip.IsNull() || coinsStatsTip.hashBlock != pcoinsTip->GetBestBlock())
+        return false;
+    stats = coinsStatsTip;
+    return true;
+}
+
+void SetTipCoinsStats(const CCoinsStats& stats)
+{
+    LOCK(cs_main);
+    if (stats.hashBlock == pcoinsTip->GetBestBlock())
+        coinsStatsTip = stats;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -813,11 +845,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
+        if (!coin.IsSpent()) {
+            if (coin.nHeight < 0) return 0;
+            return (chainActive.Tip()->nHeight + 1) - coin.nHeight;
         } else
             return -1;
     }
@@ -978,7 +1010,16 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1042,14 +1083,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            if (view.HaveCoin(COutPoint(hash, out)))
+                return false;
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
+        // Spent inputs cannot be told apart from missing ones, so they fill in pfMissingInputs too.
         for (const CTxIn& txin : tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1095,11 +1137,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn - nValueOut;
-        double dPriority = 0;
-        
-        view.GetPriority(tx, chainActive.Height());
+        double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1107,6 +1147,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         if (mapObfuscationBroadcastTxes.count(hash)) {
             mempool.PrioritiseTransaction(hash, hash.ToString(), 1000, 0.1 * COIN);
         } else if (!ignoreFees) {
+            // Once the pool has been trimmed, the feerate of the evicted
+            // packages sets a floor that decays over time.
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
             if (fLimitFree && nFees < txMinFee)
                 return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
@@ -1146,6 +1194,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+                REJECT_NONSTANDARD, "too-long-mempool-chain");
 
         bool fCLTVHasMajority = true;
 
@@ -1175,7 +1233,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1239,14 +1304,15 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
+            for (size_t out = 0; out < tx.vout.size(); out++) {
+                if (view.HaveCoin(COutPoint(hash, out)))
+                    return false;
+            }
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            // Spent inputs cannot be told apart from missing ones, so they fill in pfMissingInputs too.
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1296,7 +1362,7 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1399,10 +1465,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { 
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1477,6 +1542,36 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CDiskBlockPos& pos)
+{
+    // Open history file at the index header written in front of the block
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s : invalid block position %s", __func__, pos.ToString());
+    hpos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    // Read the block bytes as they are, without deserializing them. The
+    // disk and network serializations of a block are the same.
+    try {
+        MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s : block magic mismatch for %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE_CURRENT)
+            return error("%s : block size %u too large for %s", __func__, nSize, pos.ToString());
+        ssBlock.resize(nSize);
+        filein.read((char*)&ssBlock[0], nSize);
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
@@ -1674,14 +1769,15 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            Coin coin;
+            bool ret = inputs.SpendCoin(txin.prevout, &coin);
             assert(ret);
+            txundo.vprevout.push_back(CTxInUndo(coin.out, coin.fCoinBase, coin.fCoinStake, coin.nHeight));
         }
     }
 
     // Add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
@@ -1703,14 +1799,9 @@ CAmount GetInvalidUTXOValue()
 {
     CAmount nValue = 0;
     for (auto out : invalid_out::setInvalidOutPoints) {
-        bool fSpent = false;
-        CCoinsViewCache cache(pcoinsTip);
-        const CCoins *coins = cache.AccessCoins(out.hash);
-        if(!coins || !coins->IsAvailable(out.n))
-            fSpent = true;
-
-        if (!fSpent)
-            nValue += coins->vout[out.n].nValue;
+        const Coin& coin = pcoinsTip->AccessCoin(out);
+        if (!coin.IsSpent())
+            nValue += coin.out.nValue;
     }
 
     return nValue;
@@ -1735,20 +1826,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1779,11 +1870,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1795,7 +1886,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
+                        CScriptCheck check(coin.out.scriptPubKey, tx, i,
                             flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1816,7 +1907,116 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+/** Address index type and hash of the key or script an output pays, ADDRESS_NONE for any other output */
+static int GetAddressIndexType(const CScript& scriptPubKey, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return ADDRESS_NONE;
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        return ADDRESS_PUBKEYHASH;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        return ADDRESS_SCRIPTHASH;
+    }
+    return ADDRESS_NONE;
+}
+
+namespace
+{
+/** The records one block adds to the -addressindex and -spentindex indexes */
+struct CAddressIndexUpdates {
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    //! unspent outputs the block creates and spends
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentCreated;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentSpent;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+};
+}
+
+/** Collect the index records of a block; the outputs it spends come from its undo data */
+static void GetAddressIndexUpdates(const CBlock& block, const CBlockUndo& blockundo, int nHeight, CAddressIndexUpdates& updates)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const CTxInUndo& undo = txundo.vprevout[j];
+                uint160 hashBytes;
+                int type = GetAddressIndexType(undo.txout.scriptPubKey, hashBytes);
+                if (fAddressIndex && type != ADDRESS_NONE) {
+                    updates.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, j, true), undo.txout.nValue * -1));
+                    updates.vUnspentSpent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, prevout.hash, prevout.n),
+                        CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, undo.nHeight)));
+                }
+                if (fSpentIndex)
+                    updates.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n),
+                        CSpentIndexValue(txhash, j, nHeight, undo.txout.nValue, type, hashBytes)));
+            }
+        }
+        if (!fAddressIndex)
+            continue;
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            const CTxOut& out = tx.vout[k];
+            uint160 hashBytes;
+            int type = GetAddressIndexType(out.scriptPubKey, hashBytes);
+            if (type == ADDRESS_NONE)
+                continue;
+            updates.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, k, false), out.nValue));
+            updates.vUnspentCreated.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, txhash, k),
+                CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+        }
+    }
+}
+
+/**
+ * Apply or revert the index records of a block. Outputs created and spent
+ * within the block end up absent either way: connecting adds the created
+ * outputs before erasing the spent ones, disconnecting restores the spent
+ * outputs before erasing the created ones.
+ */
+static bool WriteAddressIndexUpdates(CValidationState& state, CAddressIndexUpdates& updates, bool fConnect)
+{
+    if (fAddressIndex) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vFirst = fConnect ? updates.vUnspentCreated : updates.vUnspentSpent;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vSecond = fConnect ? updates.vUnspentSpent : updates.vUnspentCreated;
+        for (unsigned int i = 0; i < vSecond.size(); i++)
+            vSecond[i].second.SetNull();
+        vFirst.insert(vFirst.end(), vSecond.begin(), vSecond.end());
+        if (!(fConnect ? pblocktree->WriteAddressIndex(updates.vAddressIndex) : pblocktree->EraseAddressIndex(updates.vAddressIndex)))
+            return state.Abort("Failed to write address index");
+        if (!pblocktree->UpdateAddressUnspentIndex(vFirst))
+            return state.Abort("Failed to write address unspent index");
+    }
+    if (fSpentIndex) {
+        if (!fConnect) {
+            for (unsigned int i = 0; i < updates.vSpentIndex.size(); i++)
+                updates.vSpentIndex[i].second.SetNull();
+        }
+        if (!pblocktree->UpdateSpentIndex(updates.vSpentIndex))
+            return state.Abort("Failed to write spent index");
+    }
+    return true;
+}
+
+/** Write the filter of a connected block, chaining its header to the previous block's */
+static bool WriteBlockFilter(CValidationState& state, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    CBlockFilter filter(block, blockundo);
+    uint256 hashPrevHeader = 0;
+    if (pindex->pprev && !pblocktree->ReadBlockFilterHeader(pindex->pprev->GetBlockHash(), hashPrevHeader))
+        return state.Abort("Failed to read previous block filter header");
+    if (!pblocktree->WriteBlockFilter(filter, filter.ComputeHeader(hashPrevHeader)))
+        return state.Abort("Failed to write block filter");
+    return true;
+}
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CCoinsStats* pstats)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
         LogPrintf("%s : pindex=%s view=%s\n", __func__, pindex->GetBlockHash().GetHex(), view.GetBestBlock().GetHex());
@@ -1837,6 +2037,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // Statistics are only updated once the whole block has been undone
+    CCoinsStats stats;
+    bool fStats = pstats && !pstats->IsNull() && pstats->hashBlock == pindex->GetBlockHash();
+    if (fStats)
+        stats = *pstats;
+
     // Undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction& tx = block.vtx[i];
@@ -1844,25 +2050,17 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly, removing them as we go. Provably unspendable outputs were never added.
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (!fSpent || tx.vout[o] != coin.out || coin.nHeight != pindex->nHeight ||
+                coin.fCoinBase != tx.IsCoinBase() || coin.fCoinStake != tx.IsCoinStake())
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // Remove outputs
-            outs->Clear();
+            if (fSpent && fStats)
+                stats.SpendCoin(COutPoint(hash, o), coin);
         }
 
         // Restore inputs
@@ -1873,24 +2071,23 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint& out = tx.vin[j].prevout;
                 const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // Undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
+                Coin coin(undo.txout, undo.nHeight, undo.fCoinBase, undo.fCoinStake);
+                if (undo.nHeight == 0) {
+                    // Older undo data only has metadata for the last output of the prevout tx
+                    // being spent. Inputs are restored in reverse, so that one is back already.
+                    const Coin& alternate = AccessByTxid(view, out.hash);
+                    if (alternate.IsSpent())
+                        return error("DisconnectBlock() : undo data adding output to missing transaction");
+                    coin.nHeight = alternate.nHeight;
+                    coin.fCoinBase = alternate.fCoinBase;
+                    coin.fCoinStake = alternate.fCoinStake;
                 }
-                if (coins->IsAvailable(out.n))
+                bool fOverwrite = view.HaveCoin(out);
+                if (fOverwrite)
                     fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                view.AddCoin(out, coin, fOverwrite);
+                if (fStats && !coin.out.scriptPubKey.IsUnspendable())
+                    stats.AddCoin(out, coin);
             }
         }
     }
@@ -1898,6 +2095,24 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // Move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (pstats) {
+        if (fStats && fClean) {
+            stats.hashBlock = pindex->pprev->GetBlockHash();
+            stats.nHeight = pindex->pprev->nHeight;
+            *pstats = stats;
+        } else {
+            pstats->SetNull();
+        }
+    }
+
+    // Tolerant disconnects (pfClean) only check the undo data on a scratch view
+    if (!pfClean && (fAddressIndex || fSpentIndex)) {
+        CAddressIndexUpdates updates;
+        GetAddressIndexUpdates(block, blockUndo, pindex->nHeight, updates);
+        if (!WriteAddressIndexUpdates(state, updates, false))
+            return false;
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -1939,6 +2154,55 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+namespace
+{
+/** A slice of the inputs of the next blocks to connect, read from the coin database by a prefetch thread */
+class CCoinsPrefetch
+{
+private:
+    const std::vector<COutPoint>* pvOutPoints;
+    std::vector<Coin>* pvCoins;
+    std::vector<char>* pvFound;
+    size_t nBegin;
+    size_t nEnd;
+
+public:
+    CCoinsPrefetch() : pvOutPoints(NULL), pvCoins(NULL), pvFound(NULL), nBegin(0), nEnd(0) {}
+    CCoinsPrefetch(const std::vector<COutPoint>& vOutPointsIn, std::vector<Coin>& vCoinsIn, std::vector<char>& vFoundIn, size_t nBeginIn, size_t nEndIn) : pvOutPoints(&vOutPointsIn), pvCoins(&vCoinsIn), pvFound(&vFoundIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        // Below the cache, the flush queue and the database view can be read concurrently
+        for (size_t i = nBegin; i < nEnd; i++)
+            (*pvFound)[i] = pcoinsFlushQueue->GetCoin((*pvOutPoints)[i], (*pvCoins)[i]);
+        return true;
+    }
+
+    void swap(CCoinsPrefetch& check)
+    {
+        std::swap(pvOutPoints, check.pvOutPoints);
+        std::swap(pvCoins, check.pvCoins);
+        std::swap(pvFound, check.pvFound);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+} // namespace
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(1);
+/** Number of outpoints read by one prefetch job */
+static const size_t PREFETCH_BATCH_SIZE = 16;
+/** Number of upcoming blocks whose inputs are prefetched together */
+static const int PREFETCH_WINDOW = 8;
+/** Last block whose inputs have been prefetched into pcoinsTip, reset when the cache is flushed */
+static CBlockIndex* pindexPrefetched = NULL;
+
+void ThreadPrefetchCoins()
+{
+    RenameThread("mktcash-prefetch");
+    prefetchqueue.Thread();
+}
+
 bool RecalculateMCHSupply(int nHeightStart)
 {
     if (nHeightStart > chainActive.Height())
@@ -1996,7 +2260,7 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked, CCoinsStats* pstats)
 {
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
@@ -2012,6 +2276,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
+        if (!fJustCheck && fBlockFilterIndex && !WriteBlockFilter(state, block, CBlockUndo(), pindex))
+            return false;
         view.SetBestBlock(pindex->GetBlockHash());
         return true;
     }
@@ -2049,10 +2315,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2179,9 +2446,43 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (fAddressIndex || fSpentIndex) {
+        CAddressIndexUpdates updates;
+        GetAddressIndexUpdates(block, blockundo, pindex->nHeight, updates);
+        if (!WriteAddressIndexUpdates(state, updates, true))
+            return false;
+    }
+
+    // Filters are kept when the block is disconnected, like the block itself
+    if (fBlockFilterIndex && !WriteBlockFilter(state, block, blockundo, pindex))
+        return false;
+
     // Add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
+    if (pstats) {
+        if (!pstats->IsNull() && pstats->hashBlock == hashPrevBlock) {
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                const CTransaction& tx = block.vtx[i];
+                if (i > 0) {
+                    const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+                    for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                        const CTxInUndo& undo = txundo.vprevout[j];
+                        pstats->SpendCoin(tx.vin[j].prevout, Coin(undo.txout, undo.nHeight, undo.fCoinBase, undo.fCoinStake));
+                    }
+                }
+                for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                    if (!tx.vout[o].scriptPubKey.IsUnspendable())
+                        pstats->AddCoin(COutPoint(tx.GetHash(), o), Coin(tx.vout[o], pindex->nHeight, tx.IsCoinBase(), tx.IsCoinStake()));
+                }
+            }
+            pstats->hashBlock = pindex->GetBlockHash();
+            pstats->nHeight = pindex->nHeight;
+        } else {
+            pstats->SetNull();
+        }
+    }
+
     int64_t nTime3 = GetTimeMicros();
     nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
@@ -2198,62 +2499,336 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+/** Bytes used by all block and undo files */
+static uint64_t CalculateCurrentUsage()
+{
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+/** Mark the blocks of a block file as no longer on disk, so the file can be deleted. */
+static void PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+/** Delete the blk and rev files of pruned block files. Their index entries must already be on disk. */
+static void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/**
+ * Calculate the block and undo files to delete to get back under nPruneTarget.
+ * Files holding any block within the last MIN_BLOCKS_TO_KEEP blocks, or within the maximum
+ * reorganization depth, are never pruned: disconnecting a block needs its undo data and the
+ * stake checks on a fork read the blocks back to the fork point. Staking itself only needs
+ * the coins view and the block index.
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    int nKeep = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth());
+    if (chainActive.Tip()->nHeight <= std::max(Params().PruneAfterHeight(), nKeep))
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - nKeep;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64_t nBytesToPrune;
+    int count = 0;
+
+    if (nCurrentUsage + nBuffer >= nPruneTarget) {
+        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+            nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+
+            if (vinfoBlockFile[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nPruneTarget) // are we below our target?
+                break;
+
+            // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip
+            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            PruneOneBlockFile(fileNumber);
+            // Queue up the files for removal
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+            count++;
+        }
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, count);
+}
+
 enum FlushStateMode {
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
     FLUSH_STATE_ALWAYS
 };
 
+namespace
+{
+/** Everything one flush writes, captured under cs_main. The coins themselves wait in pcoinsFlushQueue. */
+struct CFlushJob {
+    std::vector<std::pair<int, CBlockFileInfo> > vFiles;
+    int nLastFile;
+    std::vector<CDiskBlockIndex> vIndex;
+    std::set<int> setFilesToPrune;
+    bool fSetBestChain;
+    CBlockLocator locator;
+
+    //! running UTXO set statistics matching the coins, written after them if not null
+    CCoinsStats coinsStats;
+
+    CFlushJob() : nLastFile(-1), fSetBestChain(false) {}
+};
+}
+
+/** Guards the hand-off between FlushStateToDisk and ThreadFlushState */
+static boost::mutex csFlushJob;
+static boost::condition_variable cvFlushJob;
+//! Job handed off and not yet picked up by the flusher thread
+static CFlushJob* pflushJob = NULL;
+//! Whether the flusher thread is writing a job
+static bool fFlushRunning = false;
+//! Why the last job the flusher thread wrote failed, empty if it did not
+static std::string strFlushError;
+
+/**
+ * Write a flush job. The order is what keeps a crash at any point consistent: block and
+ * undo data first, then the block index entries pointing into them, and only then the
+ * coins together with the best block marker, which refer to those index entries. Pruned
+ * files are deleted last, once no index entry on disk points into them.
+ * Does not need cs_main.
+ */
+static bool WriteFlushJob(const CFlushJob& job, std::string& strError)
+{
+    try {
+        FlushBlockFile();
+        for (std::vector<std::pair<int, CBlockFileInfo> >::const_iterator it = job.vFiles.begin(); it != job.vFiles.end(); it++) {
+            if (!pblocktree->WriteBlockFileInfo(it->first, it->second)) {
+                strError = "Failed to write to block index";
+                return false;
+            }
+        }
+        if (job.nLastFile >= 0 && !pblocktree->WriteLastBlockFile(job.nLastFile)) {
+            strError = "Failed to write to block index";
+            return false;
+        }
+        BOOST_FOREACH (const CDiskBlockIndex& index, job.vIndex) {
+            if (!pblocktree->WriteBlockIndex(index)) {
+                strError = "Failed to write to block index";
+                return false;
+            }
+        }
+        pblocktree->Sync();
+        if (!pcoinsFlushQueue->WritePending()) {
+            strError = "Failed to write to coin database";
+            return false;
+        }
+        if (!job.coinsStats.IsNull() && !pblocktree->WriteCoinsStats(job.coinsStats)) {
+            strError = "Failed to write to block index";
+            return false;
+        }
+        // Nothing on disk refers to the pruned files any more
+        UnlinkPrunedFiles(job.setFilesToPrune);
+    } catch (const std::runtime_error& e) {
+        strError = std::string("System error while flushing: ") + e.what();
+        return false;
+    }
+    // Update best block in wallet (so we can detect restored wallets).
+    if (job.fSetBestChain)
+        GetMainSignals().SetBestChain(job.locator);
+    return true;
+}
+
+/**
+ * Wait for the flusher thread to finish the job it is writing. A job it has not
+ * picked up yet is written right here instead. Fails with the flusher thread's
+ * error if one of its writes failed.
+ */
+static bool FinishBackgroundFlush(std::string& strError)
+{
+    boost::this_thread::disable_interruption di;
+    CFlushJob* pjob = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(csFlushJob);
+        while (fFlushRunning)
+            cvFlushJob.wait(lock);
+        if (!strFlushError.empty()) {
+            strError = strFlushError;
+            return false;
+        }
+        std::swap(pjob, pflushJob);
+    }
+    if (!pjob)
+        return true;
+    bool fOk = WriteFlushJob(*pjob, strError);
+    delete pjob;
+    return fOk;
+}
+
+static bool IsBackgroundFlushBusy()
+{
+    boost::unique_lock<boost::mutex> lock(csFlushJob);
+    return fFlushRunning || pflushJob;
+}
+
+void ThreadFlushState()
+{
+    RenameThread("mktcash-flush");
+    while (true) {
+        CFlushJob* pjob = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(csFlushJob);
+            while (!pflushJob)
+                cvFlushJob.wait(lock);
+            std::swap(pjob, pflushJob);
+            fFlushRunning = true;
+        }
+        int64_t nStart = GetTimeMicros();
+        std::string strError;
+        bool fOk;
+        {
+            boost::this_thread::disable_interruption di;
+            fOk = WriteFlushJob(*pjob, strError);
+        }
+        LogPrint("bench", "Background flush of %u block index entries: %.2fms\n", pjob->vIndex.size(), 0.001 * (GetTimeMicros() - nStart));
+        delete pjob;
+        {
+            boost::unique_lock<boost::mutex> lock(csFlushJob);
+            fFlushRunning = false;
+            if (!fOk)
+                strFlushError = strError;
+        }
+        cvFlushJob.notify_all();
+        if (!fOk)
+            AbortNode(strError);
+    }
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
  * fast is not set and it's been a while since the last write.
+ * With -backgroundflush, periodic and size triggered flushes only capture the dirty
+ * state here and leave the writing to ThreadFlushState, so validation does not wait
+ * for the disk. FLUSH_STATE_ALWAYS is complete on disk when this returns.
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        bool fCacheLarge = (mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
+        bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000;
+        // A periodic write can wait for the previous one; a large cache or an explicit flush cannot
+        if (fPeriodicWrite && !fCacheLarge && fBackgroundFlush && IsBackgroundFlushBusy())
+            fPeriodicWrite = false;
+        if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fPeriodicWrite || fFlushForPrune) {
+            // Typical Coin structures on disk are around 48 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
             // an overestimation, as most will delete an existing entry or
             // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+            if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
-            // First make sure all block and undo data is flushed to disk.
-            FlushBlockFile();
-            // Then update all block file information (which may refer to block and undo files).
-            bool fileschanged = false;
-            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
-                if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                    return state.Abort("Failed to write to block index");
-                }
-                fileschanged = true;
-                setDirtyFileInfo.erase(it++);
-            }
-            if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
-                return state.Abort("Failed to write to block index");
-            }
-            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                    return state.Abort("Failed to write to block index");
-                }
-                setDirtyBlockIndex.erase(it++);
-            }
-
-            pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
+            // Only one flush can be on its way to disk
+            std::string strError;
+            if (!FinishBackgroundFlush(strError))
+                return state.Abort(strError);
+
+            // Capture the dirty block file information and index entries.
+            CFlushJob job;
+            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); it++)
+                job.vFiles.push_back(std::make_pair(*it, vinfoBlockFile[*it]));
+            if (!setDirtyFileInfo.empty())
+                job.nLastFile = nLastBlockFile;
+            setDirtyFileInfo.clear();
+            job.vIndex.reserve(setDirtyBlockIndex.size());
+            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); it++)
+                job.vIndex.push_back(CDiskBlockIndex(*it));
+            setDirtyBlockIndex.clear();
+            job.setFilesToPrune.swap(setFilesToPrune);
+            // Move the coin changes over to the flush queue; this empties the cache.
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
-            // Update best block in wallet (so we can detect restored wallets).
+            pindexPrefetched = NULL;
+            if (coinsStatsTip.hashBlock == pcoinsTip->GetBestBlock())
+                job.coinsStats = coinsStatsTip;
             if (mode != FLUSH_STATE_IF_NEEDED) {
-                GetMainSignals().SetBestChain(chainActive.GetLocator());
+                job.fSetBestChain = true;
+                job.locator = chainActive.GetLocator();
             }
             nLastWrite = GetTimeMicros();
+
+            if (fBackgroundFlush && mode != FLUSH_STATE_ALWAYS) {
+                {
+                    boost::unique_lock<boost::mutex> lock(csFlushJob);
+                    pflushJob = new CFlushJob();
+                    std::swap(*pflushJob, job);
+                }
+                cvFlushJob.notify_all();
+            } else if (!WriteFlushJob(job, strError)) {
+                return state.Abort(strError);
+            }
         }
     } catch (const std::runtime_error& e) {
         return state.Abort(std::string("System error while flushing: ") + e.what());
@@ -2267,19 +2842,27 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    UpdateStakeModifierIndex(pindexNew);
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2318,7 +2901,7 @@ bool static DisconnectTip(CValidationState& state)
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, &coinsStatsTip))
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
@@ -2327,17 +2910,29 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    // Masternode scores must not keep using the hash of the disconnected block
+    ForgetBlockHashes(pindexDelete->nHeight);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -2380,7 +2975,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked, &coinsStatsTip);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2591,6 +3186,76 @@ static void PruneBlockIndexCandidates()
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
+/**
+ * Read the inputs of the next blocks to connect into pcoinsTip on the prefetch
+ * threads, so that connecting them does not wait on one database read at a
+ * time. Only inputs that are not cached and not created within the window are
+ * read. A coin missing from the cache is the same in the base view as at the
+ * tip, so the entries added are current.
+ */
+static void PrefetchBlockInputs(const std::vector<CBlockIndex*>& vpindexToConnect, CBlockIndex* pindexMostWork, CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+    if (!nPrefetchThreads || vpindexToConnect.empty())
+        return;
+    // Nothing to do if the next block was covered by an earlier window on this chain
+    const CBlockIndex* pindexNext = vpindexToConnect.back();
+    if (pindexPrefetched && pindexPrefetched->nHeight >= pindexNext->nHeight && pindexMostWork->GetAncestor(pindexPrefetched->nHeight) == pindexPrefetched)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    std::set<uint256> setCreated;
+    std::vector<COutPoint> vOutPoints;
+    CBlockIndex* pindexLast = NULL;
+    int nBlocks = 0;
+    BOOST_REVERSE_FOREACH (CBlockIndex* pindex, vpindexToConnect) {
+        if (nBlocks >= PREFETCH_WINDOW)
+            break;
+        CBlock blockRead;
+        const CBlock* pblockRead = &blockRead;
+        if (pindex == pindexMostWork && pblock)
+            pblockRead = pblock;
+        else if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(blockRead, pindex))
+            break;
+        BOOST_FOREACH (const CTransaction& tx, pblockRead->vtx) {
+            setCreated.insert(tx.GetHash());
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (!txin.prevout.IsNull() && !setCreated.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vOutPoints.push_back(txin.prevout);
+            }
+        }
+        pindexLast = pindex;
+        nBlocks++;
+    }
+    if (!pindexLast)
+        return;
+    std::sort(vOutPoints.begin(), vOutPoints.end());
+    vOutPoints.erase(std::unique(vOutPoints.begin(), vOutPoints.end()), vOutPoints.end());
+
+    std::vector<Coin> vCoins(vOutPoints.size());
+    std::vector<char> vFound(vOutPoints.size(), 0);
+    {
+        CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+        std::vector<CCoinsPrefetch> vJobs;
+        vJobs.reserve((vOutPoints.size() + PREFETCH_BATCH_SIZE - 1) / PREFETCH_BATCH_SIZE);
+        for (size_t i = 0; i < vOutPoints.size(); i += PREFETCH_BATCH_SIZE)
+            vJobs.push_back(CCoinsPrefetch(vOutPoints, vCoins, vFound, i, std::min(i + PREFETCH_BATCH_SIZE, vOutPoints.size())));
+        control.Add(vJobs);
+        control.Wait();
+    }
+    int nFound = 0;
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        if (vFound[i]) {
+            pcoinsTip->AddPrefetchedCoin(vOutPoints[i], vCoins[i]);
+            nFound++;
+        }
+    }
+    pindexPrefetched = pindexLast;
+    LogPrint("bench", "    - Prefetch %d blocks: %u inputs, %d found: %.2fms\n", nBlocks, vOutPoints.size(), nFound, (GetTimeMicros() - nTimeStart) * 0.001);
+}
+
 static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMostWork, CBlock* pblock, bool fAlreadyChecked)
 {
     AssertLockHeld(cs_main);
@@ -2623,6 +3288,8 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
         nHeight = nTargetHeight;
 
+        PrefetchBlockInputs(vpindexToConnect, pindexMostWork, pblock);
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
             if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
@@ -2948,6 +3615,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE* file = OpenBlockFile(pos);
                 if (file) {
@@ -2978,6 +3647,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -3002,10 +3673,12 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+// The checks of CheckBlock() that only depend on the block itself. They are
+// safe to run without cs_main, and a block that passed them with both its
+// proof of work and merkle root checked is marked fChecked so they are not
+// repeated.
+static bool CheckBlockContextFree(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
-    // These are checks that are independent of context.
-
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, block.IsProofOfWork()))
@@ -3066,6 +3739,28 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                 return state.DoS(100, error("CheckBlock() : more than one coinstake"));
     }
 
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+
+    unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+    if (nSigOps > nMaxBlockSigOps)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+            REJECT_INVALID, "bad-blk-sigops", true);
+
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
+    return true;
+}
+
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+{
+    // These are checks that are independent of context.
+    if (!block.fChecked && !CheckBlockContextFree(block, state, fCheckPOW, fCheckMerkleRoot))
+        return false;
+
     // ----------- swiftTX transaction scanning -----------
     if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -3117,17 +3812,86 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         }
     }
 
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
+    return true;
+}
+
+static void PrevalidateBlock(const CBlock& block)
+{
+    CValidationState state;
+    if (CheckBlockContextFree(block, state, true, true))
+        block.fSigChecked = CheckBlockSignature(block);
+}
+
+/**
+ * Runs the context-free block checks (header, merkle root, structure, block
+ * signature) on worker threads for blocks that are queued ahead of the one
+ * being connected, so only contextual validation is left under cs_main.
+ * The results are recorded in CBlock::fChecked and CBlock::fSigChecked.
+ */
+class CBlockPrevalidationQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    //! Blocks waiting for a worker
+    std::deque<std::shared_ptr<CBlock> > queue;
+    //! Blocks a worker is checking right now
+    std::set<const CBlock*> setRunning;
+
+public:
+    void Thread()
+    {
+        while (true) {
+            std::shared_ptr<CBlock> pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    condWorker.wait(lock);
+                pblock = queue.front();
+                queue.pop_front();
+                setRunning.insert(pblock.get());
+            }
+            PrevalidateBlock(*pblock);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                setRunning.erase(pblock.get());
+            }
+            condDone.notify_all();
+        }
     }
 
-    unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-    if (nSigOps > nMaxBlockSigOps)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-            REJECT_INVALID, "bad-blk-sigops", true);
+    void Add(const std::shared_ptr<CBlock>& pblock)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(pblock);
+        }
+        condWorker.notify_one();
+    }
 
-    return true;
+    //! Take a block back from the queue, waiting if a worker is still checking it
+    void Wait(const CBlock* pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (std::deque<std::shared_ptr<CBlock> >::iterator it = queue.begin(); it != queue.end(); ++it) {
+            if (it->get() == pblock) {
+                queue.erase(it);
+                return;
+            }
+        }
+        while (setRunning.count(pblock))
+            condDone.wait(lock);
+    }
+};
+
+// Workers are started alongside the script check threads (-par)
+static CBlockPrevalidationQueue blockprevalidationqueue;
+
+void ThreadBlockPrevalidation()
+{
+    RenameThread("mktcash-blockchk");
+    blockprevalidationqueue.Thread();
 }
 
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
@@ -3355,6 +4119,11 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // Processed before and pruned since, which only happens to blocks deeper than any
+    // reorganization we would follow: there is no point in storing it again.
+    if (pindex->nTx != 0)
+        return true;
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3452,16 +4221,18 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         const CCoinsViewCache coins(pcoinsTip);
         
         for (const CTxIn& in: stakeTxIn.vin) {
-            const CCoins* coin = coins.AccessCoins(in.prevout.hash);
+            const Coin& coin = coins.AccessCoin(in.prevout);
 
-            if(!coin && !isBlockFromFork){
+            if(coin.IsSpent() && !isBlockFromFork){
                 // No coins on the main chain
                 return error("%s: coin stake inputs not available on main chain, received height %d vs current %d", __func__, nHeight, chainActive.Height());
             }
-            if(coin && !coin->IsAvailable(in.prevout.n)){
-                // If this is not available get the height of the spent and validate it with the forked height
+            if(coin.IsSpent()){
+                // If this is not available get the height of the transaction from one of its other
+                // outputs and validate it with the forked height
                 // Check if this occurred before the chain split
-                if(!(isBlockFromFork && coin->nHeight > splitHeight)){
+                const Coin& txcoin = AccessByTxid(coins, in.prevout.hash);
+                if(!txcoin.IsSpent() && txcoin.nHeight <= splitHeight){
                     // Coins not available
                     return error("%s: coin stake inputs already spent in main chain", __func__);
                 }
@@ -3544,7 +4315,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     int64_t nStartTime = GetTimeMillis();
     bool checked = CheckBlock(*pblock, state);
 
-    if (!CheckBlockSignature(*pblock))
+    if (!pblock->fSigChecked && !CheckBlockSignature(*pblock))
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
@@ -3711,9 +4482,211 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Version of the block index snapshot file format. */
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 2;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "indexsnapshot.dat";
+}
+
+/**
+ * Fixed-width record of one block index entry in the snapshot. Entries are
+ * stored by height, so pprev and pskip are positions of earlier records and
+ * pnext is the position of a later one; all of them can be linked without
+ * any hash lookups.
+ */
+class CBlockIndexSnapshotEntry
+{
+public:
+    CBlockIndex* pindex;
+    uint256 hash;
+    int32_t nPrevPos;
+    int32_t nSkipPos;
+    int32_t nNextPos;
+
+    CBlockIndexSnapshotEntry(CBlockIndex* pindexIn, int32_t nPrevPosIn = -1, int32_t nSkipPosIn = -1, int32_t nNextPosIn = -1) : pindex(pindexIn), nPrevPos(nPrevPosIn), nSkipPos(nSkipPosIn), nNextPos(nNextPosIn)
+    {
+        if (pindex->phashBlock)
+            hash = pindex->GetBlockHash();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hash);
+        READWRITE(nPrevPos);
+        READWRITE(nSkipPos);
+        READWRITE(nNextPos);
+        READWRITE(pindex->nHeight);
+        READWRITE(pindex->nFile);
+        READWRITE(pindex->nDataPos);
+        READWRITE(pindex->nUndoPos);
+        READWRITE(pindex->nStatus);
+        READWRITE(pindex->nTx);
+        READWRITE(pindex->nChainWork);
+        READWRITE(pindex->nMint);
+        READWRITE(pindex->nMoneySupply);
+        READWRITE(pindex->nFlags);
+        READWRITE(pindex->nStakeModifier);
+        READWRITE(pindex->prevoutStake);
+        READWRITE(pindex->nStakeTime);
+        READWRITE(pindex->hashProofOfStake);
+        READWRITE(pindex->nVersion);
+        READWRITE(pindex->hashMerkleRoot);
+        READWRITE(pindex->nTime);
+        READWRITE(pindex->nBits);
+        READWRITE(pindex->nNonce);
+        READWRITE(pindex->nAccumulatorCheckpoint);
+    }
+};
+
+bool WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    std::map<const CBlockIndex*, int32_t> mapPos;
+    for (size_t i = 0; i < vSortedByHeight.size(); i++)
+        mapPos[vSortedByHeight[i].second] = i;
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = GetDataDir() / "blocks" / "indexsnapshot.dat.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : failed to open %s", __func__, pathTmp.string());
+
+    try {
+        // The checksum covers the header and every record
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        const uint64_t nEntries = vSortedByHeight.size();
+        const uint256 hashBestChain = pcoinsTip->GetBestBlock();
+        fileout << FLATDATA(Params().MessageStart()) << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << nEntries;
+        hasher << FLATDATA(Params().MessageStart()) << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << nEntries;
+        BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
+            CBlockIndex* pindex = item.second;
+            CBlockIndexSnapshotEntry entry(pindex,
+                pindex->pprev ? mapPos[pindex->pprev] : -1,
+                pindex->pskip ? mapPos[pindex->pskip] : -1,
+                pindex->pnext ? mapPos[pindex->pnext] : -1);
+            fileout << entry;
+            hasher << entry;
+        }
+        fileout << hasher.GetHash();
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("%s : rename of %s failed", __func__, pathTmp.string());
+
+    LogPrintf("%s: wrote %u block index entries\n", __func__, vSortedByHeight.size());
+    return true;
+}
+
+/**
+ * Rebuild mapBlockIndex from the snapshot written at the last clean shutdown,
+ * in one linear pass without leveldb iteration or header hashing. Entries are
+ * returned in height order. On any mismatch mapBlockIndex is left empty and
+ * the caller falls back to the block tree database.
+ */
+static bool LoadBlockIndexSnapshot(vector<CBlockIndex*>& vSorted)
+{
+    assert(mapBlockIndex.empty());
+
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    FILE* file = fopen(pathSnapshot.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+
+    bool fValid = false;
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        unsigned char pchMsgTmp[4];
+        int nSnapshotVersion;
+        uint256 hashBestChain;
+        uint64_t nEntries;
+        filein >> FLATDATA(pchMsgTmp) >> nSnapshotVersion >> hashBestChain >> nEntries;
+        hasher << FLATDATA(pchMsgTmp) << nSnapshotVersion << hashBestChain << nEntries;
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) || nSnapshotVersion != BLOCK_INDEX_SNAPSHOT_VERSION) {
+            LogPrintf("%s: snapshot is for another network or format, ignoring\n", __func__);
+        } else if (hashBestChain != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: snapshot does not match the chainstate, ignoring\n", __func__);
+        } else {
+            vSorted.reserve(nEntries);
+            vector<int32_t> vNextPos;
+            vNextPos.reserve(nEntries);
+            for (uint64_t i = 0; i < nEntries; i++) {
+                vSorted.push_back(new CBlockIndex());
+                CBlockIndexSnapshotEntry entry(vSorted.back());
+                filein >> entry;
+                hasher << entry;
+                if (entry.nPrevPos >= (int64_t)i || entry.nSkipPos >= (int64_t)i)
+                    throw std::runtime_error("entry links forward");
+                if (entry.nNextPos >= 0 && (entry.nNextPos <= (int64_t)i || entry.nNextPos >= (int64_t)nEntries))
+                    throw std::runtime_error("entry links to a missing successor");
+                vNextPos.push_back(entry.nNextPos);
+
+                CBlockIndex* pindexNew = entry.pindex;
+                BlockMap::iterator mi = mapBlockIndex.insert(make_pair(entry.hash, pindexNew)).first;
+                if (mi->second != pindexNew)
+                    throw std::runtime_error("duplicate entry");
+                pindexNew->phashBlock = &mi->first;
+                pindexNew->pprev = entry.nPrevPos < 0 ? NULL : vSorted[entry.nPrevPos];
+                pindexNew->pskip = entry.nSkipPos < 0 ? NULL : vSorted[entry.nSkipPos];
+                // ppcoin: build setStakeSeen
+                if (pindexNew->IsProofOfStake())
+                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
+            // Successors come later in the file, so they are linked once all entries exist
+            for (uint64_t i = 0; i < nEntries; i++)
+                vSorted[i]->pnext = vNextPos[i] < 0 ? NULL : vSorted[vNextPos[i]];
+            uint256 hashChecksum;
+            filein >> hashChecksum;
+            if (hashChecksum != hasher.GetHash())
+                LogPrintf("%s: snapshot checksum mismatch, ignoring\n", __func__);
+            else
+                fValid = true;
+        }
+    } catch (std::exception& e) {
+        LogPrintf("%s: snapshot is unreadable (%s), ignoring\n", __func__, e.what());
+    }
+
+    if (!fValid) {
+        BOOST_FOREACH (CBlockIndex* pindex, vSorted)
+            delete pindex;
+        vSorted.clear();
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        return false;
+    }
+
+    LogPrintf("%s: loaded %u block index entries from snapshot\n", __func__, vSorted.size());
+    return true;
+}
+
 bool static LoadBlockIndexDB(string& strError)
 {
-    if (!pblocktree->LoadBlockIndexGuts())
+    // A snapshot is only trusted by the first startup after the clean
+    // shutdown that wrote it, so it is removed whether or not it was used.
+    vector<CBlockIndex*> vSnapshot;
+    bool fSnapshot = GetBoolArg("-fastblockindex", DEFAULT_FASTBLOCKINDEX) && LoadBlockIndexSnapshot(vSnapshot);
+    try {
+        boost::filesystem::remove(GetBlockIndexSnapshotPath());
+    } catch (const boost::filesystem::filesystem_error& e) {
+        LogPrintf("%s: failed to remove block index snapshot: %s\n", __func__, e.what());
+    }
+    if (!fSnapshot && !pblocktree->LoadBlockIndexGuts())
         return false;
 
     boost::this_thread::interruption_point();
@@ -3721,15 +4694,24 @@ bool static LoadBlockIndexDB(string& strError)
     // Calculate nChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
-    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    if (fSnapshot) {
+        // Already in height order, with chain work and skip pointers filled in
+        BOOST_FOREACH (CBlockIndex* pindex, vSnapshot)
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    } else {
+        for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        if (!fSnapshot)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3745,7 +4727,7 @@ bool static LoadBlockIndexDB(string& strError)
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fSnapshot)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
@@ -3789,6 +4771,11 @@ bool static LoadBlockIndexDB(string& strError)
     pblocktree->ReadFlag("shutdown", fLastShutdownWasPrepared);
     LogPrintf("%s: Last shutdown was prepared: %s\n", __func__, fLastShutdownWasPrepared);
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
@@ -3798,6 +4785,18 @@ bool static LoadBlockIndexDB(string& strError)
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether we have a block filter index
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("LoadBlockIndexDB(): block filter index %s\n", fBlockFilterIndex ? "enabled" : "disabled");
+
     // If this is written true before the next client init, then we know the shutdown process failed
     pblocktree->WriteFlag("shutdown", false);
 
@@ -3806,9 +4805,15 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    UpdateStakeModifierIndex(it->second);
 
     PruneBlockIndexCandidates();
 
+    // Running UTXO set statistics are only of use if they were written along with these coins
+    CCoinsStats stats;
+    if (pblocktree->ReadCoinsStats(stats) && stats.hashBlock == pcoinsTip->GetBestBlock())
+        coinsStatsTip = stats;
+
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3850,6 +4855,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3867,7 +4877,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3909,7 +4919,10 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    UpdateStakeModifierIndex(NULL);
     pindexBestInvalid = NULL;
+    pindexPrefetched = NULL;
+    coinsStatsTip.SetNull();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -3931,6 +4944,12 @@ bool InitBlockIndex()
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", true);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3961,18 +4980,78 @@ bool InitBlockIndex()
 }
 
 
+// Process a block read from an external block file, followed by any of its
+// earlier encountered successors. Returns false if a system error occurred.
+static bool ProcessExternalBlock(CBlock& block, CDiskBlockPos* dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+{
+    try {
+        // detect out of order blocks, and store them for later
+        uint256 hash = block.GetHash();
+        if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+            LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+            if (dbp)
+                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+            return true;
+        }
+
+        // process in case the block isn't known yet
+        if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+            CValidationState state;
+            if (ProcessNewBlock(state, NULL, &block, dbp))
+                nLoaded++;
+            if (state.IsError())
+                return false;
+        } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+            LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+        }
+
+        // Recursively process earlier encountered successors of this block
+        deque<uint256> queue;
+        queue.push_back(hash);
+        while (!queue.empty()) {
+            uint256 head = queue.front();
+            queue.pop_front();
+            std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+            while (range.first != range.second) {
+                std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                if (ReadBlockFromDisk(block, it->second)) {
+                    LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        head.ToString());
+                    CValidationState dummy;
+                    if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
+                        nLoaded++;
+                        queue.push_back(block.GetHash());
+                    }
+                }
+                range.first++;
+                mapBlocksUnknownParent.erase(it);
+            }
+        }
+    } catch (std::exception& e) {
+        LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
     static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
+    // Blocks read ahead of the one being processed, with their positions,
+    // while the prevalidation threads check them
+    std::deque<std::pair<std::shared_ptr<CBlock>, CDiskBlockPos> > vPending;
+    const size_t nMaxPending = nScriptCheckThreads * 2;
+    bool fError = false;
+
     int nLoaded = 0;
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        while (!blkdat.eof() && !fError) {
             boost::this_thread::interruption_point();
 
             blkdat.SetPos(nRewind);
@@ -4002,56 +5081,29 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                     dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                std::shared_ptr<CBlock> pblock(new CBlock());
+                blkdat >> *pblock;
                 nRewind = blkdat.GetPos();
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                        block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
-
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
+                vPending.push_back(std::make_pair(pblock, dbp ? *dbp : CDiskBlockPos()));
+                if (nMaxPending)
+                    blockprevalidationqueue.Add(pblock);
             } catch (std::exception& e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
+
+            while (vPending.size() > nMaxPending && !fError) {
+                blockprevalidationqueue.Wait(vPending.front().first.get());
+                fError = !ProcessExternalBlock(*vPending.front().first, dbp ? &vPending.front().second : NULL, mapBlocksUnknownParent, nLoaded);
+                vPending.pop_front();
+            }
+        }
+
+        while (!vPending.empty() && !fError) {
+            boost::this_thread::interruption_point();
+            blockprevalidationqueue.Wait(vPending.front().first.get());
+            fError = !ProcessExternalBlock(*vPending.front().first, dbp ? &vPending.front().second : NULL, mapBlocksUnknownParent, nLoaded);
+            vPending.pop_front();
         }
     } catch (std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
@@ -4097,6 +5149,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -4104,6 +5157,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4114,12 +5168,21 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
-        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
+        // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4131,9 +5194,18 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and
+                // is valid and we have all data for its parents, it must be in
+                // setBlockIndexCandidates.  chainActive.Tip() must also be there
+                // even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip()) {
+                    assert(setBlockIndexCandidates.count(pindex));
+                }
+                // If some parent is missing, then it could be that this block was in
+                // setBlockIndexCandidates but had to be removed because of the missing data.
+                // In this case it must be in mapBlocksUnlinked -- see test below.
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
@@ -4149,12 +5221,25 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);          // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if:
+            //  - it has a descendant that at some point had more work than the tip, and
+            //  - we tried switching to that descendant but were missing data for some intermediate block between chainActive and the tip.
+            // So if this block is itself better than chainActive.Tip() and it wasn't in
+            // setBlockIndexCandidates, then it must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL) {
+                    assert(foundInUnlinked);
+                }
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -4174,6 +5259,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4269,7 +5355,8 @@ bool static AlreadyHave(const CInv& inv)
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
@@ -4308,8 +5395,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4321,31 +5406,50 @@ void static ProcessGetData(CNode* pfrom)
             it++;
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                // Only the block index lookup needs cs_main; the block itself
+                // is read from disk and pushed without holding it.
+                CDiskBlockPos blockPos;
+                uint256 hashContinueTip;
+                {
+                    LOCK(cs_main);
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
+                        }
+                    }
+                    // Don't send not-validated blocks
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                        blockPos = mi->second->GetBlockPos();
+                        if (inv.hash == pfrom->hashContinue) {
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                            pfrom->hashContinue = 0;
                         }
                     }
                 }
-                // Don't send not-validated blocks
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                CBlock block;
+                if (!blockPos.IsNull() && !(inv.type == MSG_BLOCK ? ReadRawBlockFromDisk(ssBlock, blockPos) : ReadBlockFromDisk(block, blockPos))) {
+                    // With -prune the file can be deleted between the index lookup and the read
+                    if (!fPruneMode)
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    LogPrint("net", "ProcessGetData(): block %s was pruned, peer=%d\n", inv.hash.ToString(), pfrom->id);
+                    vNotFound.push_back(inv);
+                } else if (!blockPos.IsNull()) {
+                    if (inv.type == MSG_BLOCK) {
+                        // Send the block straight from its on-disk serialization
+                        pfrom->PushMessage("block", ssBlock);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -4367,17 +5471,17 @@ void static ProcessGetData(CNode* pfrom)
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue) {
+                    if (hashContinueTip != 0) {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
                         pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
                     }
                 }
             } else if (inv.IsKnownType()) {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool pushed = false;
                 {
@@ -4499,7 +5603,7 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, CBlock* pblockRecv)
 {
     RandAddSeedPerfmon();
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -4677,9 +5781,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
                     uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
@@ -4799,6 +5901,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // If pruning, don't inv blocks unless we have on disk and are likely to still have
+            // for some reasonable time window (1 hour) that block relay might require.
+            const int nPrunedBlocksLikelyToHave = MIN_BLOCKS_TO_KEEP - 3600 / Params().TargetSpacing();
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave)) {
+                LogPrint("net", " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0) {
                 // When this block is requested, we'll send an inv that'll make them
@@ -4866,6 +5975,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
+            // mapObfuscationBroadcastTxes and allowFreeTx are shared with other handler threads
+            LOCK(cs_main);
             CMasternode* pmn = mnodeman.Find(vin);
             if (pmn != NULL) {
                 if (!pmn->allowFreeTx) {
@@ -5060,28 +6171,42 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        // The block may already have been deserialized and prevalidated ahead
+        CBlock blockRecv;
+        if (!pblockRecv)
+            vRecv >> blockRecv;
+        CBlock& block = pblockRecv ? *pblockRecv : blockRecv;
         uint256 hashBlock = block.GetHash();
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
+        // Other handler threads may be adding to mapBlockIndex and moving chainActive
+        bool fHavePrev, fHaveBlock;
+        CBlockLocator locator;
+        {
+            LOCK(cs_main);
+            fHavePrev = mapBlockIndex.count(block.hashPrevBlock);
+            fHaveBlock = mapBlockIndex.count(hashBlock);
+            if (!fHavePrev)
+                locator = chainActive.GetLocator();
+        }
+
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        if (!fHavePrev) {
             if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+                pfrom->PushMessage("getblocks", locator, block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
             } else {
                 //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                pfrom->PushMessage("getblocks", locator, hashBlock);
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
             pfrom->AddInventoryKnown(inv);
 
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
+            if (!fHaveBlock) {
                 ProcessNewBlock(state, pfrom, &block);
                 int nDoS;
                 if(state.IsInvalid(nDoS)) {
@@ -5106,7 +6231,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH (const CAddress& addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5313,6 +6441,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     } else {
         //probably one the extensions
+        // These run without cs_main; each one serializes its messages under its
+        // own lock, as peers are handled on several message threads at once
         obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
         mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
         masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
@@ -5338,6 +6468,40 @@ int ActiveProtocol()
 }
 
 // requires LOCK(cs_vRecvMsg)
+// Deserialize the blocks waiting in a peer's receive queue during initial
+// block download and hand them to the prevalidation threads, so their
+// context-free checks are done by the time the message handler gets to them.
+static void PrevalidateReceivedBlocks(CNode* pfrom)
+{
+    static const int MAX_PREVALIDATED_BLOCKS_AHEAD = 16;
+
+    if (!nScriptCheckThreads || fImporting || fReindex || pfrom->vRecvMsg.size() < 2 || !IsInitialBlockDownload())
+        return;
+
+    int nAhead = 0;
+    for (std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin(); it != pfrom->vRecvMsg.end() && nAhead < MAX_PREVALIDATED_BLOCKS_AHEAD; ++it) {
+        CNetMessage& msg = *it;
+        if (!msg.complete())
+            break;
+        if (msg.hdr.GetCommand() != "block")
+            continue;
+        nAhead++;
+        if (msg.pblock)
+            continue;
+
+        std::shared_ptr<CBlock> pblock(new CBlock());
+        try {
+            CDataStream vRecv(msg.vRecv);
+            vRecv >> *pblock;
+        } catch (const std::exception&) {
+            // Left to ProcessMessage() to reject
+            continue;
+        }
+        msg.pblock = pblock;
+        blockprevalidationqueue.Add(pblock);
+    }
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //
@@ -5356,6 +6520,8 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    PrevalidateReceivedBlocks(pfrom);
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -5404,7 +6570,9 @@ bool ProcessMessages(CNode* pfrom)
         // Process message
         bool fRet = false;
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (msg.pblock)
+                blockprevalidationqueue.Wait(msg.pblock.get());
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, msg.pblock.get());
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -5485,8 +6653,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5500,21 +6670,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle) {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000) {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+            {
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), i + 1000)));
         }
 
         CNodeState& state = *State(pto->GetId());
@@ -5575,9 +6743,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle) {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint256 hashRand = inv.hash ^ hashSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
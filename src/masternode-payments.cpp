@@ -304,6 +304,8 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
 
     if (fLiteMode) return; // Disable all Obfuscation/Masternode related functionality
 
+    LOCK(cs_process_message);
+
     if (strCommand == "mnget") { // Masternode Payments Request Sync
         if (fLiteMode) return;   // Disable all Obfuscation/Masternode related functionality
 
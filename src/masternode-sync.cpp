@@ -172,6 +172,8 @@ std::string CMasternodeSync::GetSyncStatus()
 
 void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
+    LOCK(cs_process_message);
+
     if (strCommand == "ssc") { //Sync status count
         int nItemID;
         int nCount;
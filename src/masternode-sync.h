@@ -28,6 +28,10 @@ extern CMasternodeSync masternodeSync;
 
 class CMasternodeSync
 {
+private:
+    // critical section to protect the inner data structures specifically on messaging
+    mutable CCriticalSection cs_process_message;
+
 public:
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
@@ -14,7 +14,103 @@
 // Keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
 // Cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
+static CCriticalSection cs_mapCacheBlockHashes;
+static std::map<int64_t, uint256> mapCacheBlockHashes;
+// Bumped whenever blocks are disconnected
+static unsigned int nCacheBlockHashesGeneration = 0;
+// Unspent masternode collaterals
+CMasternodeCollaterals mnCollaterals;
+
+void CMasternodeCollaterals::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    LOCK(cs);
+    if (mapCollaterals.empty())
+        return;
+
+    // A confirmed spend retires the collateral. Spends entering the mempool
+    // are left to mempool.isSpent(), as they may yet be dropped.
+    if (pblock) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            mapCollaterals.erase(txin.prevout);
+        return;
+    }
+
+    // Transactions leaving the chain take their outputs with them
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        mapCollaterals.erase(COutPoint(tx.GetHash(), i));
+}
+
+CollateralState CMasternodeCollaterals::Get(const COutPoint& outpoint, int& nHeight)
+{
+    bool fFound = false;
+    {
+        LOCK(cs);
+        std::map<COutPoint, CCollateral>::const_iterator it = mapCollaterals.find(outpoint);
+        if (it != mapCollaterals.end()) {
+            nHeight = it->second.nHeight;
+            fFound = true;
+        }
+    }
+
+    if (!fFound) {
+        Coin coin;
+        {
+            TRY_LOCK(cs_main, lockMain);
+            if (!lockMain) return COLLATERAL_UNKNOWN;
+
+            if (!pcoinsTip->GetCoin(outpoint, coin) || coin.IsSpent()) {
+                // Funded by a tx still in the mempool: not mature, but not spent either
+                CTransaction txFunding;
+                if (!mempool.lookup(outpoint.hash, txFunding) || outpoint.n >= txFunding.vout.size())
+                    return COLLATERAL_SPENT;
+                if (txFunding.vout[outpoint.n].nValue < MIN_VALUE)
+                    return COLLATERAL_INVALID;
+                nHeight = chainActive.Height() + 1;
+                return mempool.isSpent(outpoint) ? COLLATERAL_SPENT : COLLATERAL_UNCONFIRMED;
+            }
+            if (coin.out.nValue < MIN_VALUE)
+                return COLLATERAL_INVALID;
+
+            // Under cs_main, so no block can be connected before it is watched
+            LOCK(cs);
+            CCollateral& collateral = mapCollaterals[outpoint];
+            collateral.nValue = coin.out.nValue;
+            collateral.nHeight = coin.nHeight;
+        }
+        nHeight = coin.nHeight;
+    }
+
+    if (mempool.isSpent(outpoint))
+        return COLLATERAL_SPENT;
+
+    return COLLATERAL_OK;
+}
+
+int CMasternodeCollaterals::GetAge(const COutPoint& outpoint)
+{
+    int nHeight;
+    switch (Get(outpoint, nHeight)) {
+    case COLLATERAL_OK:
+        return chainActive.Height() + 1 - nHeight;
+    case COLLATERAL_UNCONFIRMED:
+    case COLLATERAL_UNKNOWN:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+size_t CMasternodeCollaterals::Size() const
+{
+    LOCK(cs);
+    return mapCollaterals.size();
+}
+
+void CMasternodeCollaterals::Clear()
+{
+    LOCK(cs);
+    mapCollaterals.clear();
+}
 
 // Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
@@ -24,9 +120,15 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
     if (nBlockHeight == 0)
         nBlockHeight = chainActive.Tip()->nHeight;
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
+    unsigned int nGeneration;
+    {
+        LOCK(cs_mapCacheBlockHashes);
+        std::map<int64_t, uint256>::const_iterator it = mapCacheBlockHashes.find(nBlockHeight);
+        if (it != mapCacheBlockHashes.end()) {
+            hash = it->second;
+            return true;
+        }
+        nGeneration = nCacheBlockHashesGeneration;
     }
 
     const CBlockIndex* BlockLastSolved = chainActive.Tip();
@@ -42,7 +144,10 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
     for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
         if (n >= nBlocksAgo) {
             hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
+            LOCK(cs_mapCacheBlockHashes);
+            // A walk that raced with a disconnect may have read the old chain
+            if (nGeneration == nCacheBlockHashesGeneration)
+                mapCacheBlockHashes[nBlockHeight] = hash;
             return true;
         }
         n++;
@@ -57,6 +162,15 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
     return false;
 }
 
+// Forget the cached hashes of the blocks from nHeight up, which are being disconnected
+void ForgetBlockHashes(int nHeight)
+{
+    LOCK(cs_mapCacheBlockHashes);
+    // The hash cached for a height is that of the block below it
+    mapCacheBlockHashes.erase(mapCacheBlockHashes.upper_bound(nHeight), mapCacheBlockHashes.end());
+    nCacheBlockHashesGeneration++;
+}
+
 CMasternode::CMasternode()
 {
     LOCK(cs);
@@ -165,13 +279,19 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     if (chainActive.Tip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
+    return CalculateScore(hash);
+}
+
+uint256 CMasternode::CalculateScore(const uint256& hash) const
+{
+    uint256 aux = vin.prevout.hash + vin.prevout.n;
+
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
     uint256 hash2 = ss.GetHash();
@@ -213,20 +333,13 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut(149999.99 * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+        int nHeight;
+        CollateralState collateralState = mnCollaterals.Get(vin.prevout, nHeight);
+        if (collateralState == COLLATERAL_UNKNOWN) return;
 
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
-
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
-            }
+        if (collateralState == COLLATERAL_SPENT || collateralState == COLLATERAL_INVALID) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
         }
     }
 
@@ -585,31 +698,25 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
             mnodeman.Remove(pmn->vin);
     }
 
-    CValidationState state;
-    CMutableTransaction tx = CMutableTransaction();
-    CTxOut vout = CTxOut(149999.99 * COIN, obfuScationPool.collateralPubKey);
-    tx.vin.push_back(vin);
-    tx.vout.push_back(vout);
-
-    {
-        TRY_LOCK(cs_main, lockMain);
-        if (!lockMain) {
-            // Not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-            masternodeSync.mapSeenSyncMNB.erase(GetHash());
-            return false;
-        }
+    int nCollateralHeight;
+    CollateralState collateralState = mnCollaterals.Get(vin.prevout, nCollateralHeight);
+    if (collateralState == COLLATERAL_UNKNOWN) {
+        // Not mnb fault, let it to be checked again later
+        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+        masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        return false;
+    }
 
-        if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-            // Set nDos
-            state.IsInvalid(nDoS);
-            return false;
-        }
+    if (collateralState == COLLATERAL_SPENT || collateralState == COLLATERAL_INVALID) {
+        // An output too small to be a collateral is as bad as overspending it
+        if (collateralState == COLLATERAL_INVALID) nDoS = 100;
+        return false;
     }
 
     LogPrint("masternode", "mnb - Accepted Masternode entry\n");
 
-    if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
+    int nInputAge = chainActive.Height() + 1 - nCollateralHeight;
+    if (nInputAge < MASTERNODE_MIN_CONFIRMATIONS) {
         LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // Maybe we miss few blocks, let this mnb to be checked again later
         mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
@@ -619,19 +726,13 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     // Verify that sig time is legit in past
     // should be at least not earlier than block when 150000 MCH tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 150000 MCH tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
-            LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
-                sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-            return false;
-        }
+    // The collateral is unspent, so its height comes from the coins view; no block data is
+    // needed and this works on a pruned node too
+    CBlockIndex* pConfIndex = chainActive[chainActive.Height() + MASTERNODE_MIN_CONFIRMATIONS - nInputAge]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+    if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
+        LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
+            sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+        return false;
     }
 
     LogPrint("masternode","mnb - Got NEW Masternode entry - %s - %lli \n", vin.prevout.hash.ToString(), sigTime);
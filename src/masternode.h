@@ -14,6 +14,7 @@
 #include "sync.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 15
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -28,9 +29,54 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
+class CMasternodeCollaterals;
+extern CMasternodeCollaterals mnCollaterals;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
+void ForgetBlockHashes(int nHeight);
+
+enum CollateralState {
+    COLLATERAL_OK,
+    COLLATERAL_UNCONFIRMED, // created by a mempool tx; its height is that of the next block
+    COLLATERAL_UNKNOWN,     // not looked up yet and cs_main is busy, try again later
+    COLLATERAL_SPENT,       // spent in the chain or the mempool, or in neither the UTXO set nor the mempool
+    COLLATERAL_INVALID,     // not worth a masternode collateral
+};
+
+//
+// Watch set of masternode collateral outputs
+//
+// Collaterals are read from the UTXO set the first time they are looked up,
+// then kept up to date from the transactions of connected and disconnected
+// blocks. Checking a known collateral takes neither cs_main nor a mempool
+// acceptance probe. Only unspent collaterals are kept, so spent masternodes
+// cost a lookup in the coins view, as before.
+//
+
+class CMasternodeCollaterals : public CValidationInterface
+{
+private:
+    struct CCollateral {
+        CAmount nValue;
+        int nHeight;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<COutPoint, CCollateral> mapCollaterals;
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    // Value the collateral must cover: the output of the mempool probe this replaces
+    static const CAmount MIN_VALUE = (CAmount)(149999.99 * COIN);
+
+    CollateralState Get(const COutPoint& outpoint, int& nHeight);
+    // Confirmations of the collateral, -1 if it is not a valid unspent collateral, 0 if unconfirmed or unknown
+    int GetAge(const COutPoint& outpoint);
+    size_t Size() const;
+    void Clear();
+};
 
 
 //
@@ -193,6 +239,8 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    // Score against the block hash GetBlockHash() gave for the height; touches no global state
+    uint256 CalculateScore(const uint256& hashBlock) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -260,7 +308,7 @@ public:
         if (chainActive.Tip() == NULL) return 0;
 
         if (cacheInputAge == 0) {
-            cacheInputAge = GetInputAge(vin);
+            cacheInputAge = mnCollaterals.GetAge(vin.prevout);
             cacheInputAgeBlock = chainActive.Tip()->nHeight;
         }
 
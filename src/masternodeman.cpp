@@ -11,7 +11,9 @@
 #include "obfuscation.h"
 #include "spork.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
 
@@ -26,21 +28,21 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+struct CompareScoreIndex {
+    bool operator()(const pair<uint256, unsigned int>& t1,
+        const pair<uint256, unsigned int>& t2) const
     {
         return t1.first < t2.first;
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
+// Score the Masternodes in [nBegin, nEnd) against a block; runs on several threads for big lists
+static void ScoreMasternodes(const std::vector<CMasternode>& vMasternodes, const uint256& hashBlock,
+    std::vector<pair<uint256, unsigned int> >& vScores, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        vScores[i] = make_pair(vMasternodes[i].CalculateScore(hashBlock), (unsigned int)i);
+}
 
 //
 // CMasternodeDB
@@ -210,6 +212,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        listRankTables.clear();
         return true;
     }
 
@@ -279,6 +282,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vMasternodes.erase(it);
+            listRankTables.clear();
         } else {
             ++it;
         }
@@ -340,6 +344,7 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    listRankTables.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -597,18 +602,71 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
+const CMasternodeMan::CRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight)
+{
+    // Make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::list<CRankTable>::iterator it = listRankTables.begin();
+    while (it != listRankTables.end()) {
+        if (it->nBlockHeight != nBlockHeight) {
+            ++it;
+        } else if (it->hashBlock != hash) {
+            // Scored against a block that has been reorganized away
+            it = listRankTables.erase(it);
+        } else {
+            listRankTables.splice(listRankTables.begin(), listRankTables, it);
+            return &listRankTables.front();
+        }
+    }
+
+    listRankTables.push_front(CRankTable());
+    CRankTable& table = listRankTables.front();
+    table.nBlockHeight = nBlockHeight;
+    table.hashBlock = hash;
+    table.vScores.resize(vMasternodes.size());
+
+    size_t nThreads = 1;
+    if (vMasternodes.size() >= MASTERNODES_PARALLEL_SCORE_MIN)
+        nThreads = std::max(1U, boost::thread::hardware_concurrency());
+
+    if (nThreads == 1) {
+        ScoreMasternodes(vMasternodes, hash, table.vScores, 0, vMasternodes.size());
+    } else {
+        size_t nSlice = (vMasternodes.size() + nThreads - 1) / nThreads;
+        boost::thread_group threadGroup;
+        for (size_t nBegin = 0; nBegin < vMasternodes.size(); nBegin += nSlice) {
+            size_t nEnd = std::min(nBegin + nSlice, vMasternodes.size());
+            threadGroup.create_thread(boost::bind(&ScoreMasternodes, boost::cref(vMasternodes), boost::cref(hash),
+                boost::ref(table.vScores), nBegin, nEnd));
+        }
+        threadGroup.join_all();
+    }
+
+    sort(table.vScores.rbegin(), table.vScores.rend(), CompareScoreIndex());
+
+    if (listRankTables.size() > MASTERNODES_RANK_TABLES)
+        listRankTables.pop_back();
+
+    return &table;
+}
+
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    // Make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const CRankTable* pTable = GetRankTable(nBlockHeight);
+    if (!pTable) return -1;
+
+    // Walk the Masternodes from the best score down, counting those that qualify
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, unsigned int) & s, pTable->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -627,18 +685,8 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -648,66 +696,55 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    LOCK(cs);
+
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    // Make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const CRankTable* pTable = GetRankTable(nBlockHeight);
+    if (!pTable) return vecMasternodeRanks;
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // Enabled Masternodes by score, followed by the others
+    std::vector<unsigned int> vDisabled;
+    BOOST_FOREACH (const PAIRTYPE(uint256, unsigned int) & s, pTable->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vDisabled.push_back(s.second);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeRanks.push_back(make_pair(vecMasternodeRanks.size() + 1, mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
-    }
+    BOOST_FOREACH (unsigned int i, vDisabled)
+        vecMasternodeRanks.push_back(make_pair(vecMasternodeRanks.size() + 1, vMasternodes[i]));
 
     return vecMasternodeRanks;
 }
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
+    const CRankTable* pTable = GetRankTable(nBlockHeight);
+    if (!pTable) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, unsigned int) & s, pTable->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -991,21 +1028,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         // Make sure it's still unspent
         //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
 
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut(149999.99 * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        bool fAcceptable = false;
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
-            fAcceptable = AcceptableInputs(mempool, state, CTransaction(tx), false, NULL);
-        }
+        int nCollateralHeight;
+        CollateralState collateralState = mnCollaterals.Get(vin.prevout, nCollateralHeight);
+        if (collateralState == COLLATERAL_UNKNOWN) return;
 
-        if (fAcceptable) {
-            if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
+        if (collateralState == COLLATERAL_OK || collateralState == COLLATERAL_UNCONFIRMED) {
+            int nInputAge = chainActive.Height() + 1 - nCollateralHeight;
+            if (nInputAge < MASTERNODE_MIN_CONFIRMATIONS) {
                 LogPrintf("CMasternodeMan::ProcessMessage() : dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
                 Misbehaving(pfrom->GetId(), 20);
                 return;
@@ -1013,18 +1042,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
             // Verify that sig time is legit in past
             // should be at least not earlier than block when 150000 MCH tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 150000 MCH tx -> 1 confirmation
-                CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if (pConfIndex->GetBlockTime() > sigTime) {
-                    LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
-                        sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-                    return;
-                }
+            // The collateral is unspent, so its height comes from the coins view; no block data is
+            // needed and this works on a pruned node too
+            CBlockIndex* pConfIndex = chainActive[chainActive.Height() + MASTERNODE_MIN_CONFIRMATIONS - nInputAge]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+            if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
+                LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
+                    sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+                return;
             }
 
             // Use this as a peer
@@ -1058,12 +1082,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         } else {
             LogPrint("masternode","dsee - Rejected Masternode entry %s\n", vin.prevout.hash.ToString());
 
-            int nDoS = 0;
-            if (state.IsInvalid(nDoS)) {
-                LogPrint("masternode","dsee - %s from %i %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+            if (collateralState == COLLATERAL_INVALID) {
+                LogPrint("masternode","dsee - collateral %s from %i %s is too small\n", vin.prevout.ToString(),
                     pfrom->GetId(), pfrom->cleanSubVer.c_str());
-                if (nDoS > 0)
-                    Misbehaving(pfrom->GetId(), nDoS);
+                Misbehaving(pfrom->GetId(), 100);
             }
         }
     }
@@ -1141,6 +1163,7 @@ void CMasternodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
             vMasternodes.erase(it);
+            listRankTables.clear();
             break;
         }
         ++it;
@@ -15,8 +15,12 @@
 #include "sync.h"
 #include "util.h"
 
+#include <list>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_RANK_TABLES 16           // Score tables kept, one per block height
+#define MASTERNODES_PARALLEL_SCORE_MIN 1024  // Score bigger lists on several threads
 
 using namespace std;
 
@@ -67,6 +71,18 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // All Masternodes by descending score for one block, as indexes into vMasternodes
+    struct CRankTable {
+        int64_t nBlockHeight;
+        uint256 hashBlock;
+        std::vector<pair<uint256, unsigned int> > vScores;
+    };
+    // Recently used score tables, most recent first; emptied whenever vMasternodes changes
+    std::list<CRankTable> listRankTables;
+
+    /// Get the score table for a block height, NULL if the block is unknown
+    const CRankTable* GetRankTable(int64_t nBlockHeight);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -90,6 +106,9 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+
+        if (ser_action.ForRead())
+            listRankTables.clear();
     }
 
     CMasternodeMan();
@@ -28,8 +28,8 @@
 #include "spork.h"
 #include "invalid.h"
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -38,51 +38,20 @@ using namespace std;
 // MCHMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
-    {
-    }
-};
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// The priority part of the block is filled from a heap of (priority, entry):
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
@@ -95,6 +64,275 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
 }
 
+CBlockTemplateCache::CBlockTemplateCache(CTxMemPool& poolIn) : pool(poolIn), fDirty(true), nHeight(0), nRemoved(0), nBlockSize(0), nBlockSigOps(0),
+                                                                 nBlockMaxSize(0), nBlockPrioritySize(0), nBlockMinSize(0)
+{
+    connAdded = pool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::TransactionAdded, this, _1));
+    connRemoved = pool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::TransactionRemoved, this, _1));
+    connUpdated = pool.NotifyEntryUpdated.connect(boost::bind(&CBlockTemplateCache::TransactionUpdated, this, _1));
+}
+
+// Whether an entry can be appended to the selection. Inputs and scripts were
+// checked when the entry was accepted and the pool is kept consistent with
+// the tip, so only the block limits and finality are looked at here; the
+// finished block still goes through TestBlockValidity.
+bool CBlockTemplateCache::TestEntry(CTxMemPool::txiter iter) const
+{
+    const CTransaction& tx = iter->GetTx();
+
+    if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+        return false;
+
+    if (nBlockSigOps + iter->GetSigOpCount() >= MAX_BLOCK_SIGOPS_CURRENT)
+        return false;
+
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+        return false;
+
+    // Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+    for (const CTxIn& txin : tx.vin) {
+        if (invalid_out::ContainsOutPoint(txin.prevout)) {
+            LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+            return false;
+        }
+    }
+    return true;
+}
+
+void CBlockTemplateCache::AddEntry(CTxMemPool::txiter iter)
+{
+    mapSelected.insert(std::make_pair(iter, vSelected.size()));
+    vSelected.push_back(iter);
+    nBlockSize += iter->GetTxSize();
+    nBlockSigOps += iter->GetSigOpCount();
+}
+
+bool CBlockTemplateCache::HasUnselectedParent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, pool.GetMemPoolParents(iter)) {
+        if (!mapSelected.count(parent))
+            return true;
+    }
+    return false;
+}
+
+void CBlockTemplateCache::Rebuild()
+{
+    vSelected.clear();
+    mapSelected.clear();
+    nRemoved = 0;
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    minPackageRate = ::minRelayTxFee;
+    fDirty = false;
+
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    // High-priority transactions first, included regardless of the fees
+    // they pay. Priorities were fixed when the entries were accepted, so
+    // this only ages them to the new height; no coins are looked up.
+    if (nBlockPrioritySize > 0) {
+        vector<TxCoinAgePriority> vecPriority;
+        TxCoinAgePriorityCompare pricomparer;
+        std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+        vecPriority.reserve(pool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            pool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+        while (!vecPriority.empty()) {
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            double dPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+
+            // Children wait until all of their parents are in the block.
+            if (HasUnselectedParent(iter)) {
+                waitPriMap.insert(std::make_pair(iter, dPriority));
+                continue;
+            }
+
+            // Switch to ordering by fee once past the priority size or
+            // we run out of high-priority transactions.
+            if (nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+                break;
+
+            if (!TestEntry(iter))
+                continue;
+            AddEntry(iter);
+
+            // Queue any children that were waiting on this one.
+            BOOST_FOREACH (CTxMemPool::txiter child, pool.GetMemPoolChildren(iter)) {
+                std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+
+    // Fill the rest of the block straight from the mempool's ancestor
+    // feerate index, adding each candidate together with whatever
+    // ancestors are not in the block yet. Scores are not recomputed as
+    // ancestors get included, so the order is an approximation of the
+    // best package order.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type& ancestorIndex = pool.mapTx.get<ancestor_score>();
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    int nConsecutiveFailed = 0;
+    for (CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = ancestorIndex.begin(); mi != ancestorIndex.end(); ++mi) {
+        CTxMemPool::txiter iter = pool.mapTx.project<0>(mi);
+        if (mapSelected.count(iter))
+            continue;
+
+        // Everything else we might consider has a lower fee rate, so stop
+        // once packages pay less than the relay fee and the minimum block
+        // size is reached.
+        CFeeRate packageRate(mi->GetModFeesWithAncestors(), mi->GetSizeWithAncestors());
+        if (packageRate < ::minRelayTxFee && nBlockSize >= nBlockMinSize)
+            break;
+
+        // Give up on a nearly full block rather than walking the rest of
+        // a large mempool for something small enough to fit.
+        if (nConsecutiveFailed > 1000 && nBlockSize + 4000 > nBlockMaxSize)
+            break;
+
+        CTxMemPool::setEntries ancestors;
+        std::string dummy;
+        pool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        vector<CTxMemPool::txiter> vPackage;
+        uint64_t nPackageSize = iter->GetTxSize();
+        BOOST_FOREACH (CTxMemPool::txiter ancestor, ancestors) {
+            if (!mapSelected.count(ancestor)) {
+                vPackage.push_back(ancestor);
+                nPackageSize += ancestor->GetTxSize();
+            }
+        }
+        if (nBlockSize + nPackageSize >= nBlockMaxSize) {
+            // Anything paying no more than this may be left out later on.
+            minPackageRate = packageRate;
+            ++nConsecutiveFailed;
+            continue;
+        }
+        vPackage.push_back(iter);
+
+        // An entry always has more ancestors than any of its ancestors,
+        // so this is a valid topological order.
+        std::sort(vPackage.begin(), vPackage.end(), [](CTxMemPool::txiter a, CTxMemPool::txiter b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+        bool fAdded = true;
+        BOOST_FOREACH (CTxMemPool::txiter entry, vPackage) {
+            if (!TestEntry(entry)) {
+                fAdded = false;
+                break;
+            }
+            AddEntry(entry);
+        }
+        if (fAdded)
+            nConsecutiveFailed = 0;
+        else
+            ++nConsecutiveFailed;
+    }
+
+    LogPrint("bench", "    - Block template selection rebuilt: %u txs, %u bytes\n", vSelected.size(), nBlockSize);
+}
+
+void CBlockTemplateCache::GetSelection(const uint256& hashPrevBlockIn, int nHeightIn, std::vector<CTxMemPool::txiter>& vtx)
+{
+    AssertLockHeld(pool.cs);
+
+    if (fDirty || hashPrevBlockIn != hashPrevBlock || nHeightIn != nHeight) {
+        hashPrevBlock = hashPrevBlockIn;
+        nHeight = nHeightIn;
+        Rebuild();
+    } else if (nRemoved > 0) {
+        // Drop the holes left by removed entries.
+        std::vector<CTxMemPool::txiter> vKeep;
+        vKeep.reserve(vSelected.size() - nRemoved);
+        BOOST_FOREACH (CTxMemPool::txiter iter, vSelected) {
+            if (iter != pool.mapTx.end()) {
+                mapSelected[iter] = vKeep.size();
+                vKeep.push_back(iter);
+            }
+        }
+        vSelected.swap(vKeep);
+        nRemoved = 0;
+    }
+
+    vtx = vSelected;
+}
+
+void CBlockTemplateCache::TransactionAdded(CTxMemPool::txiter iter)
+{
+    if (fDirty)
+        return;
+
+    CFeeRate packageRate(iter->GetModFeesWithAncestors(), iter->GetSizeWithAncestors());
+    if (packageRate >= ::minRelayTxFee && !HasUnselectedParent(iter) && TestEntry(iter)) {
+        AddEntry(iter);
+        return;
+    }
+
+    // It did not fit after what is already selected; only rebuild if a
+    // rebuild could order it (or a package it completes) differently.
+    if (packageRate > minPackageRate || nBlockSize < nBlockMinSize ||
+        (nBlockPrioritySize > 0 && AllowFree(iter->GetPriority(nHeight))))
+        fDirty = true;
+}
+
+void CBlockTemplateCache::TransactionRemoved(CTxMemPool::txiter iter)
+{
+    if (fDirty)
+        return;
+
+    std::map<CTxMemPool::txiter, size_t, CTxMemPool::CompareIteratorByHash>::iterator it = mapSelected.find(iter);
+    if (it == mapSelected.end())
+        return;
+
+    vSelected[it->second] = pool.mapTx.end();
+    ++nRemoved;
+    nBlockSize -= iter->GetTxSize();
+    nBlockSigOps -= iter->GetSigOpCount();
+    mapSelected.erase(it);
+
+    // Entries that were left out may fit in the room freed up, and its
+    // ancestors may only have been selected as part of its package.
+    if (pool.mapTx.size() > mapSelected.size() + 1 || !pool.GetMemPoolParents(iter).empty())
+        fDirty = true;
+}
+
+void CBlockTemplateCache::TransactionUpdated(CTxMemPool::txiter iter)
+{
+    fDirty = true;
+}
+
+static CBlockTemplateCache& GetBlockTemplateCache()
+{
+    static CBlockTemplateCache cache(mempool);
+    return cache;
+}
+
 std::pair<int, std::pair<uint256, uint256> > pCheckpointCache;
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
 {
@@ -150,23 +388,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block.
     CAmount nFees = 0;
 
@@ -175,188 +396,26 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions.
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-
-            for (const CTxIn& txin : tx.vin) {               
-                // Read prev transaction.
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies.
-                    if (!porphan) {
-                        // Use list for automatic deletion.
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                // Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-                    fMissingInputs = true;
-                    break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-
-            }
-
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize.
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block.
+        // Collect transactions into block. The selection is kept up to date
+        // as transactions enter and leave the mempool, so this is mostly a copy.
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added.
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
+        std::vector<CTxMemPool::txiter> vSelected;
+        GetBlockTemplateCache().GetSelection(pindexPrev->GetBlockHash(), nHeight, vSelected);
+        pblock->vtx.reserve(pblock->vtx.size() + vSelected.size());
+        BOOST_FOREACH (CTxMemPool::txiter iter, vSelected) {
+            pblock->vtx.push_back(iter->GetTx());
+            pblocktemplate->vTxFees.push_back(iter->GetFee());
+            pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+            nBlockSize += iter->GetTxSize();
             ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum& bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
+            nFees += iter->GetFee();
 
             if (fPrintPriority) {
                 LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue.
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+                    iter->GetPriority(nHeight), CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
             }
         }
 
@@ -7,8 +7,13 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "txmempool.h"
+#include "uint256.h"
+
 #include <stdint.h>
 
+#include <boost/signals2/connection.hpp>
+
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
@@ -18,6 +23,54 @@ class CWallet;
 
 struct CBlockTemplate;
 
+/**
+ * Keeps the mempool transactions that would go into the next block, in block
+ * order, up to date as entries enter and leave the pool. New entries whose
+ * parents are already selected are appended in place; anything that could
+ * change the order of what is already selected marks the selection dirty and
+ * it is rebuilt on the next request. A new tip always rebuilds.
+ *
+ * All state is guarded by pool.cs.
+ */
+class CBlockTemplateCache
+{
+public:
+    explicit CBlockTemplateCache(CTxMemPool& poolIn);
+
+    /** Get the selection for a block at nHeight on top of hashPrevBlock. pool.cs must be held. */
+    void GetSelection(const uint256& hashPrevBlock, int nHeight, std::vector<CTxMemPool::txiter>& vtx);
+
+private:
+    CTxMemPool& pool;
+    boost::signals2::scoped_connection connAdded, connRemoved, connUpdated;
+
+    bool fDirty;
+    uint256 hashPrevBlock;
+    int nHeight;
+
+    //! Selected entries in block order; removed ones are left as mapTx.end() until the next request
+    std::vector<CTxMemPool::txiter> vSelected;
+    std::map<CTxMemPool::txiter, size_t, CTxMemPool::CompareIteratorByHash> mapSelected;
+    size_t nRemoved;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    //! Package feerate of the last package selected by fee
+    CFeeRate minPackageRate;
+
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+
+    bool TestEntry(CTxMemPool::txiter iter) const;
+    void AddEntry(CTxMemPool::txiter iter);
+    bool HasUnselectedParent(CTxMemPool::txiter iter) const;
+    void Rebuild();
+
+    void TransactionAdded(CTxMemPool::txiter iter);
+    void TransactionRemoved(CTxMemPool::txiter iter);
+    void TransactionUpdated(CTxMemPool::txiter iter);
+};
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
@@ -47,6 +47,8 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
     if (!masternodeSync.IsBlockchainSynced()) return;
 
+    LOCK(cs_process_message);
+
     if (strCommand == "dsa") { //Obfuscation Accept Into Pool
 
         int errorID;
@@ -144,7 +146,11 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
             }
             mnodeman.nDsqCount++;
             pmn->nLastDsq = mnodeman.nDsqCount;
-            pmn->allowFreeTx = true;
+            {
+                // Read by the dstx handler under cs_main
+                LOCK(cs_main);
+                pmn->allowFreeTx = true;
+            }
 
             LogPrint("obfuscation", "dsq - new Obfuscation queue object - %s\n", addr.ToString());
             vecObfuscationQueue.push_back(dsq);
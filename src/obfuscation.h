@@ -266,6 +266,9 @@ class CObfuscationPool
 private:
     mutable CCriticalSection cs_obfuscation;
 
+    // critical section to protect the inner data structures specifically on messaging
+    mutable CCriticalSection cs_process_message;
+
     std::vector<CObfuScationEntry> entries; // Masternode/clients entries
     CMutableTransaction finalTransaction;   // the finalized transaction ready for signing
 
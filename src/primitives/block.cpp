@@ -6,6 +6,8 @@
 
 #include "primitives/block.h"
 
+#include "crypto/quark.h"
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -21,6 +23,31 @@ uint256 CBlockHeader::GetHash() const
     return Hash(BEGIN(nVersion), END(nAccumulatorCheckpoint));
 }
 
+void CBlockHeader::GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+
+    // Gather the 80-byte legacy headers (nVersion through nNonce) into one buffer
+    std::vector<unsigned char> vLegacy;
+    std::vector<size_t> vLegacyIndex;
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        const CBlockHeader& header = vHeaders[i];
+        if (header.nVersion < 4) {
+            vLegacy.insert(vLegacy.end(), BEGIN(header.nVersion), END(header.nNonce));
+            vLegacyIndex.push_back(i);
+        } else {
+            vHashes[i] = header.GetHash();
+        }
+    }
+    if (vLegacyIndex.empty())
+        return;
+
+    std::vector<unsigned char> vOut(32 * vLegacyIndex.size());
+    HashQuark80(&vOut[0], &vLegacy[0], vLegacyIndex.size());
+    for (size_t i = 0; i < vLegacyIndex.size(); i++)
+        memcpy(vHashes[vLegacyIndex[i]].begin(), &vOut[32 * i], 32);
+}
+
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
 {
     /* WARNING! If you're reading this because you're learning about crypto
@@ -66,15 +93,18 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // Adjacent pairs are contiguous 64-byte inputs, so a whole level is
+        // hashed in one batch; an odd trailing entry is paired with itself.
+        size_t nLevel = vMerkleTree.size();
+        vMerkleTree.resize(nLevel + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nLevel].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize % 2) {
+            vMerkleTree.back() = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                      BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
         }
         j += nSize;
     }
@@ -76,6 +76,9 @@ public:
 
     uint256 GetHash() const;
 
+    /** Compute GetHash() of many headers at once; legacy Quark headers are hashed as one batch. */
+    static void GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes);
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -95,6 +98,8 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked;    // context-free checks of CheckBlock() passed
+    mutable bool fSigChecked; // CheckBlockSignature() passed
 
     CBlock()
     {
@@ -124,6 +129,8 @@ public:
         vMerkleTree.clear();
         payee = CScript();
         vchBlockSig.clear();
+        fChecked = false;
+        fSigChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -214,8 +214,18 @@ void Bip38ToolDialog::on_importAddressButton_DEC_clicked()
         return;
     }
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (!reserver.Reserve()) {
+        ui->statusLabel_DEC->setStyleSheet("QLabel { color: red; }");
+        ui->statusLabel_DEC->setText(tr("Wallet is currently rescanning.") + QString(" ") + tr("Please try again."));
+        return;
+    }
+
     CKeyID vchAddress = pubkey.GetID();
+    CBlockIndex* pindexRescan;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
         ui->statusLabel_DEC->setStyleSheet("QLabel { color: red; }");
         ui->statusLabel_DEC->setText(tr("Please wait while key is imported"));
 
@@ -239,9 +249,12 @@ void Bip38ToolDialog::on_importAddressButton_DEC_clicked()
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        pindexRescan = chainActive.Genesis();
     }
 
+    // The rescan takes cs_main and cs_wallet itself, a batch of blocks at a time
+    pwalletMain->ScanForWalletTransactions(pindexRescan, reserver, true);
+
     ui->statusLabel_DEC->setStyleSheet("QLabel { color: green; }");
     ui->statusLabel_DEC->setText(tr("Successfully Added Private Key To Wallet"));
 }
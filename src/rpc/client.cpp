@@ -86,6 +86,12 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"sendrawtransaction", 2},
         {"gettxout", 1},
         {"gettxout", 2},
+        {"gettxoutsetinfo", 0},
+        {"getaddressbalance", 0},
+        {"getaddressutxos", 0},
+        {"getaddressdeltas", 0},
+        {"getaddresstxids", 0},
+        {"getspentinfo", 0},
         {"lockunspent", 0},
         {"lockunspent", 1},
         {"importprivkey", 2},
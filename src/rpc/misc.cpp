@@ -16,6 +16,7 @@
 #include "rpc/server.h"
 #include "spork.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
@@ -524,6 +525,347 @@ UniValue verifymessage(const UniValue& params, bool fHelp)
     return (pubkey.GetID() == keyID);
 }
 
+/** Address index type and hash of an address, ADDRESS_NONE if it is not one the indexes know */
+static int GetAddressIndexKey(const CBitcoinAddress& address, uint160& hashBytes)
+{
+    CTxDestination dest = address.Get();
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        return ADDRESS_PUBKEYHASH;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        return ADDRESS_SCRIPTHASH;
+    }
+    return ADDRESS_NONE;
+}
+
+static std::string GetAddressFromIndexKey(int type, const uint160& hashBytes)
+{
+    if (type == ADDRESS_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+/** The addresses of a getaddress* request, given as a single address or as {"addresses": [...]} */
+static void ParseAddressIndexAddresses(const UniValue& param, std::vector<std::pair<uint160, int> >& vAddresses)
+{
+    UniValue values(UniValue::VARR);
+    if (param.isStr()) {
+        values.push_back(param);
+    } else if (param.isObject()) {
+        values = find_value(param.get_obj(), "addresses");
+        if (!values.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with addresses");
+    }
+
+    for (unsigned int i = 0; i < values.size(); i++) {
+        CBitcoinAddress address(values[i].get_str());
+        uint160 hashBytes;
+        int type = address.IsValid() ? GetAddressIndexKey(address, hashBytes) : ADDRESS_NONE;
+        if (type == ADDRESS_NONE)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        vAddresses.push_back(std::make_pair(hashBytes, type));
+    }
+}
+
+/** The optional "start" and "end" heights of a getaddress* request, 0 when not given */
+static void ParseAddressIndexRange(const UniValue& param, int& nStart, int& nEnd)
+{
+    nStart = 0;
+    nEnd = 0;
+    if (!param.isObject())
+        return;
+    const UniValue& start = find_value(param.get_obj(), "start");
+    const UniValue& end = find_value(param.get_obj(), "end");
+    if (!start.isNull())
+        nStart = start.get_int();
+    if (!end.isNull())
+        nEnd = end.get_int();
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end are expected to be a valid height range");
+}
+
+static bool HeightInRange(int nHeight, int nStart, int nEnd)
+{
+    return nHeight >= nStart && (nEnd == 0 || nHeight <= nEnd);
+}
+
+static void ReadAddressIndex(const std::vector<std::pair<uint160, int> >& vAddresses, int nStart, int nEnd, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex and -reindex");
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        if (!pblocktree->ReadAddressIndex(it->first, it->second, addressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+    }
+}
+
+static bool AddressIndexHeightLess(const std::pair<CAddressIndexKey, CAmount>& a, const std::pair<CAddressIndexKey, CAmount>& b)
+{
+    if (a.first.blockHeight != b.first.blockHeight)
+        return a.first.blockHeight < b.first.blockHeight;
+    return a.first.txindex < b.first.txindex;
+}
+
+static bool AddressUnspentHeightLess(const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a, const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b)
+{
+    return a.second.blockHeight < b.second.blockHeight;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|{\"addresses\":[\"address\",...]}\n"
+            "\nReturns the balance of one or more addresses. Requires -addressindex.\n"
+
+            "\nArguments:\n"
+            "1. \"address\"              (string) A mktcash address, or\n"
+            "   {\n"
+            "     \"addresses\": [\"address\",...]   (array) mktcash addresses\n"
+            "   }\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": n,    (numeric) The current balance in satoshis\n"
+            "  \"received\": n    (numeric) The total received in satoshis, including change\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"]}'") +
+            HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    ReadAddressIndex(vAddresses, 0, 0, addressIndex);
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+        if (it->second > 0)
+            nReceived += it->second;
+        nBalance += it->second;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|{\"addresses\":[\"address\",...],\"start\":n,\"end\":n}\n"
+            "\nReturns the unspent outputs of one or more addresses, ordered by height. Requires -addressindex.\n"
+            "Large sets can be paged through by height range.\n"
+
+            "\nArguments:\n"
+            "1. \"address\"              (string) A mktcash address, or\n"
+            "   {\n"
+            "     \"addresses\": [\"address\",...]   (array) mktcash addresses\n"
+            "     \"start\": n           (numeric, optional) Only outputs created at or after this height\n"
+            "     \"end\": n             (numeric, optional) Only outputs created at or before this height\n"
+            "   }\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",   (string) The address\n"
+            "    \"txid\": \"hash\",         (string) The transaction id\n"
+            "    \"outputIndex\": n,       (numeric) The output index\n"
+            "    \"script\": \"hex\",        (string) The script hex encoded\n"
+            "    \"satoshis\": n,          (numeric) The value of the output in satoshis\n"
+            "    \"height\": n             (numeric) The height of the block containing the transaction\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"]}'") +
+            HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"], \"start\": 1000, \"end\": 2000}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+    int nStart, nEnd;
+    ParseAddressIndexRange(params[0], nStart, nEnd);
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex and -reindex");
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        if (!pblocktree->ReadAddressUnspentIndex(it->first, it->second, unspentOutputs))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+    }
+    std::stable_sort(unspentOutputs.begin(), unspentOutputs.end(), AddressUnspentHeightLess);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = unspentOutputs.begin(); it != unspentOutputs.end(); it++) {
+        if (!HeightInRange(it->second.blockHeight, nStart, nEnd))
+            continue;
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", GetAddressFromIndexKey(it->first.type, it->first.hashBytes)));
+        output.push_back(Pair("txid", it->first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it->first.index));
+        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
+        output.push_back(Pair("satoshis", it->second.satoshis));
+        output.push_back(Pair("height", it->second.blockHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas \"address\"|{\"addresses\":[\"address\",...],\"start\":n,\"end\":n}\n"
+            "\nReturns all changes to the balance of one or more addresses, ordered by height. Requires -addressindex.\n"
+            "Large sets can be paged through by height range.\n"
+
+            "\nArguments:\n"
+            "1. \"address\"              (string) A mktcash address, or\n"
+            "   {\n"
+            "     \"addresses\": [\"address\",...]   (array) mktcash addresses\n"
+            "     \"start\": n           (numeric, optional) The first height to include\n"
+            "     \"end\": n             (numeric, optional) The last height to include\n"
+            "   }\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\": n,          (numeric) The difference in satoshis\n"
+            "    \"txid\": \"hash\",         (string) The transaction id\n"
+            "    \"index\": n,             (numeric) The input or output index\n"
+            "    \"blockindex\": n,        (numeric) The position of the transaction in its block\n"
+            "    \"height\": n,            (numeric) The block height\n"
+            "    \"address\": \"address\"    (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"]}'") +
+            HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"], \"start\": 1000, \"end\": 2000}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+    int nStart, nEnd;
+    ParseAddressIndexRange(params[0], nStart, nEnd);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    ReadAddressIndex(vAddresses, nStart, nEnd, addressIndex);
+    if (vAddresses.size() > 1)
+        std::stable_sort(addressIndex.begin(), addressIndex.end(), AddressIndexHeightLess);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("satoshis", it->second));
+        delta.push_back(Pair("txid", it->first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it->first.index));
+        delta.push_back(Pair("blockindex", (int)it->first.txindex));
+        delta.push_back(Pair("height", it->first.blockHeight));
+        delta.push_back(Pair("address", GetAddressFromIndexKey(it->first.type, it->first.hashBytes)));
+        result.push_back(delta);
+    }
+    return result;
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids \"address\"|{\"addresses\":[\"address\",...],\"start\":n,\"end\":n}\n"
+            "\nReturns the ids of the transactions involving one or more addresses, ordered by height. Requires -addressindex.\n"
+            "Large sets can be paged through by height range.\n"
+
+            "\nArguments:\n"
+            "1. \"address\"              (string) A mktcash address, or\n"
+            "   {\n"
+            "     \"addresses\": [\"address\",...]   (array) mktcash addresses\n"
+            "     \"start\": n           (numeric, optional) The first height to include\n"
+            "     \"end\": n             (numeric, optional) The last height to include\n"
+            "   }\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"]}'") +
+            HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"mcYFhNWEgnJ4MAsMikVTwXRqq1d9c7PJNf\"], \"start\": 1000, \"end\": 2000}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+    int nStart, nEnd;
+    ParseAddressIndexRange(params[0], nStart, nEnd);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    ReadAddressIndex(vAddresses, nStart, nEnd, addressIndex);
+    if (vAddresses.size() > 1)
+        std::stable_sort(addressIndex.begin(), addressIndex.end(), AddressIndexHeightLess);
+
+    UniValue result(UniValue::VARR);
+    std::set<uint256> setSeen;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+        if (setSeen.insert(it->first.txhash).second)
+            result.push_back(it->first.txhash.GetHex());
+    }
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\":\"hash\",\"index\":n}\n"
+            "\nReturns the input spending an output. Requires -spentindex.\n"
+
+            "\nArguments:\n"
+            "1. {\n"
+            "     \"txid\": \"hash\",   (string) The id of the transaction holding the output\n"
+            "     \"index\": n        (numeric) The output index\n"
+            "   }\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\": \"hash\",      (string) The id of the spending transaction\n"
+            "  \"index\": n,          (numeric) The index of the spending input\n"
+            "  \"height\": n          (numeric) The height of the block containing the spending transaction\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'") +
+            HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}"));
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, restart with -spentindex and -reindex");
+
+    const UniValue& txid = find_value(params[0].get_obj(), "txid");
+    const UniValue& index = find_value(params[0].get_obj(), "index");
+    if (!txid.isStr() || !index.isNum())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(CSpentIndexKey(ParseHashV(txid, "txid"), index.get_int()), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.inputIndex));
+    result.push_back(Pair("height", value.blockHeight));
+    return result;
+}
+
 UniValue setmocktime(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -24,6 +24,9 @@ CSporkManager sporkManager;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
+// Serializes spork messages from peers handled on different message threads
+static CCriticalSection cs_process_spork;
+
 // MCH: on startup load spork values from previous session if they exist in the sporkDB
 void LoadSporksFromDB()
 {
@@ -60,6 +63,8 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; // Disable all obfuscation/masternode related functionality
 
+    LOCK(cs_process_spork);
+
     if (strCommand == "spork") {
         CDataStream vMsg(vRecv);
         CSporkMessage spork;
@@ -13,31 +13,46 @@ bool CMCHStake::SetInput(CTransaction txPrev, unsigned int n)
 {
     this->txFrom = txPrev;
     this->nPosition = n;
+    this->prevout = COutPoint(txPrev.GetHash(), n);
+    this->txOutFrom = txPrev.vout[n];
+    return true;
+}
+
+// Stake input known only by its outpoint, e.g. resolved from the coins view during validation
+bool CMCHStake::SetInput(const COutPoint& prevoutIn, const CTxOut& txOut, CBlockIndex* pindex)
+{
+    this->nPosition = prevoutIn.n;
+    this->prevout = prevoutIn;
+    this->txOutFrom = txOut;
+    this->pindexFrom = pindex;
     return true;
 }
 
 bool CMCHStake::GetTxFrom(CTransaction& tx)
 {
+    if (txFrom.vout.empty())
+        return false;
+
     tx = txFrom;
     return true;
 }
 
 bool CMCHStake::CreateTxIn(CWallet* pwallet, CTxIn& txIn, uint256 hashTxOut)
 {
-    txIn = CTxIn(txFrom.GetHash(), nPosition);
+    txIn = CTxIn(prevout.hash, prevout.n);
     return true;
 }
 
 CAmount CMCHStake::GetValue()
 {
-    return txFrom.vout[nPosition].nValue;
+    return txOutFrom.nValue;
 }
 
 bool CMCHStake::CreateTxOuts(CWallet* pwallet, vector<CTxOut>& vout, CAmount nTotal)
 {
     vector<valtype> vSolutions;
     txnouttype whichType;
-    CScript scriptPubKeyKernel = txFrom.vout[nPosition].scriptPubKey;
+    CScript scriptPubKeyKernel = txOutFrom.scriptPubKey;
     if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
         LogPrintf("CreateCoinStake : failed to parse kernel\n");
         return false;
@@ -86,16 +101,29 @@ CDataStream CMCHStake::GetUniqueness()
 {
     // The unique identifier for a MCH stake is the outpoint
     CDataStream ss(SER_NETWORK, 0);
-    ss << nPosition << txFrom.GetHash();
+    ss << nPosition << prevout.hash;
     return ss;
 }
 
 // The block that the UTXO was added to the chain
 CBlockIndex* CMCHStake::GetIndexFrom()
 {
+    if (pindexFrom)
+        return pindexFrom;
+
+    // An unspent input's height is in the coins view, so staking needs no block data
+    {
+        LOCK(cs_main);
+        const Coin& coin = pcoinsTip->AccessCoin(prevout);
+        if (!coin.IsSpent() && coin.nHeight > 0 && coin.nHeight <= chainActive.Height()) {
+            pindexFrom = chainActive[coin.nHeight];
+            return pindexFrom;
+        }
+    }
+
     uint256 hashBlock = 0;
     CTransaction tx;
-    if (GetTransaction(txFrom.GetHash(), tx, hashBlock, true)) {
+    if (GetTransaction(prevout.hash, tx, hashBlock, true)) {
         // If the index is in the chain, then set it as the "index from"
         if (mapBlockIndex.count(hashBlock)) {
             CBlockIndex* pindex = mapBlockIndex.at(hashBlock);
@@ -103,7 +131,7 @@ CBlockIndex* CMCHStake::GetIndexFrom()
                 pindexFrom = pindex;
         }
     } else {
-        LogPrintf("%s : failed to find tx %s\n", __func__, txFrom.GetHash().GetHex());
+        LogPrintf("%s : failed to find tx %s\n", __func__, prevout.hash.GetHex());
     }
 
     return pindexFrom;
@@ -31,6 +31,9 @@ class CMCHStake : public CStakeInput
 private:
     CTransaction txFrom;
     unsigned int nPosition;
+    //! The staked output, either taken from txFrom or resolved from the UTXO set
+    COutPoint prevout;
+    CTxOut txOutFrom;
 public:
     CMCHStake()
     {
@@ -38,6 +41,7 @@ public:
     }
 
     bool SetInput(CTransaction txPrev, unsigned int n);
+    bool SetInput(const COutPoint& prevoutIn, const CTxOut& txOut, CBlockIndex* pindex);
 
     CBlockIndex* GetIndexFrom() override;
     bool GetTxFrom(CTransaction& tx) override;
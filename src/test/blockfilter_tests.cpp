@@ -0,0 +1,220 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "clientversion.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    CGCSFilter::ElementSet included;
+    CGCSFilter::ElementSet excluded;
+    for (int i = 0; i < 100; ++i) {
+        CGCSFilter::Element element1(32);
+        element1[0] = i;
+        included.insert(element1);
+
+        CGCSFilter::Element element2(33);
+        element2[1] = i;
+        excluded.insert(element2);
+    }
+
+    CGCSFilter filter(0, 0, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    for (CGCSFilter::ElementSet::const_iterator it = included.begin(); it != included.end(); it++)
+        BOOST_CHECK(filter.Match(*it));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // With a false positive rate of 1/M, none of the excluded elements should match
+    BOOST_CHECK(!filter.MatchAny(excluded));
+
+    // Any one included element is enough for MatchAny
+    CGCSFilter::ElementSet mixed(excluded);
+    mixed.insert(*included.rbegin());
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // Decoding gives back the same filter
+    CGCSFilter decoded(0, 0, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100U);
+    BOOST_CHECK(decoded.MatchAny(included));
+    BOOST_CHECK(decoded.GetEncoded() == filter.GetEncoded());
+
+    // A different key hashes the elements elsewhere
+    CGCSFilter rekeyed(1, 2, included);
+    BOOST_CHECK(rekeyed.GetEncoded() != filter.GetEncoded());
+    BOOST_CHECK(rekeyed.MatchAny(included));
+
+    // Truncated or padded encodings are refused
+    std::vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().end() - 1);
+    BOOST_CHECK_THROW(CGCSFilter(0, 0, vTruncated), std::ios_base::failure);
+    std::vector<unsigned char> vPadded(filter.GetEncoded());
+    vPadded.push_back(0);
+    BOOST_CHECK_THROW(CGCSFilter(0, 0, vPadded), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_default_constructor)
+{
+    CGCSFilter filter;
+    BOOST_CHECK_EQUAL(filter.GetN(), 0U);
+    BOOST_CHECK_EQUAL(filter.GetEncoded().size(), 1U);
+
+    CGCSFilter::ElementSet elements;
+    elements.insert(CGCSFilter::Element(1, 0x51));
+    BOOST_CHECK(!filter.MatchAny(elements));
+
+    CGCSFilter empty(0, 0, CGCSFilter::ElementSet());
+    BOOST_CHECK(empty.GetEncoded() == filter.GetEncoded());
+}
+
+// Known answers from an independent implementation of BIP 158, which gives the
+// vector of the BIP for the testnet genesis block
+BOOST_AUTO_TEST_CASE(gcsfilter_known_answer_test)
+{
+    // BIP 158 testnet genesis vector: the keys are the first 16 bytes of the block hash
+    std::vector<unsigned char> vScript = ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac");
+    CGCSFilter::ElementSet elements;
+    elements.insert(vScript);
+    CGCSFilter filter(0x719526f8d77f4943ULL, 0xaec3ced90fa3f408ULL, elements);
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncoded()), "019dfca8");
+
+    CBlockFilter blockfilter(uint256S("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"), ParseHex("019dfca8"));
+    BOOST_CHECK(blockfilter.GetFilter().Match(vScript));
+    BOOST_CHECK_EQUAL(blockfilter.ComputeHeader(uint256(0)).GetHex(), "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+
+    // Enough elements for a multi-byte count and quotients above one
+    CGCSFilter::ElementSet many;
+    for (int i = 0; i < 300; i++) {
+        CGCSFilter::Element element(2);
+        element[0] = i & 0xff;
+        element[1] = i >> 8;
+        many.insert(element);
+    }
+    CGCSFilter large(0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL, many);
+    const std::vector<unsigned char>& vEncoded = large.GetEncoded();
+    BOOST_CHECK_EQUAL(vEncoded.size(), 793U);
+    BOOST_CHECK_EQUAL(HexStr(vEncoded.begin(), vEncoded.begin() + 8), "fd2c012d6e39a5a6");
+    BOOST_CHECK_EQUAL(Hash(vEncoded.begin(), vEncoded.end()).GetHex(), "091ca45d207025319cc3ee1b537fe6bd028a8028f5a60998b38f4bb5d6cb41a0");
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_known_answer_test)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig << OP_1;
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = CScript() << ParseHex("03" + std::string(64, '1')) << OP_CHECKSIG;
+    coinbase.vout[1].scriptPubKey = CScript() << OP_RETURN << ParseHex("deadbeef");
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(1), 0);
+    tx.vout.resize(4);
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x22) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].scriptPubKey = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 0x33) << OP_EQUAL;
+    tx.vout[2].SetEmpty();
+    // Duplicates are counted once
+    tx.vout[3].scriptPubKey = coinbase.vout[0].scriptPubKey;
+
+    CBlock block;
+    block.nTime = 1546300800;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 1;
+    block.vtx.push_back(CTransaction(coinbase));
+    block.vtx.push_back(CTransaction(tx));
+    BOOST_CHECK_EQUAL(block.GetHash().GetHex(), "198d150aeac34a1f22fe8e034b0626eb5b44dfec5925f618e7841342d0bc0db7");
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    CScript spent = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x44) << OP_EQUALVERIFY << OP_CHECKSIG;
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(20, spent), false, false, 1));
+
+    CBlockFilter blockfilter(block, blockundo);
+    BOOST_CHECK_EQUAL(blockfilter.GetFilter().GetN(), 4U);
+    BOOST_CHECK_EQUAL(HexStr(blockfilter.GetEncodedFilter()), "04c421e0bd96d6295ef51080");
+    BOOST_CHECK_EQUAL(blockfilter.GetHash().GetHex(), "faede25c7133e372df42770e397b0884705518bf6cff830895877b265fb056d2");
+    // Chained onto the header of the genesis vector above
+    uint256 hashPrevHeader = uint256S("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+    BOOST_CHECK_EQUAL(blockfilter.ComputeHeader(hashPrevHeader).GetHex(), "994e36d76ced1e22497d5a72c5dc4f94af23be5e9b4c00a5dbc90d9b7bb3aa83");
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    CScript included_scripts[4];
+    included_scripts[0] << std::vector<unsigned char>(33, 1) << OP_CHECKSIG;
+    included_scripts[1] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUALVERIFY << OP_CHECKSIG;
+    included_scripts[2] << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUAL;
+    // A spent output
+    included_scripts[3] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 4) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CScript excluded_scripts[3];
+    excluded_scripts[0] << OP_RETURN << OP_4 << OP_ADD << OP_8 << OP_EQUAL;
+    // A script of an input, rather than of the output it spends
+    excluded_scripts[1] << std::vector<unsigned char>(72, 5);
+    excluded_scripts[2] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 6) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig << OP_1;
+    coinbase.vout.resize(2);
+    coinbase.vout[0].nValue = 50;
+    coinbase.vout[0].scriptPubKey = included_scripts[0];
+    coinbase.vout[1].nValue = 0;
+    coinbase.vout[1].scriptPubKey = excluded_scripts[0];
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(1), 0);
+    tx.vin[0].scriptSig = excluded_scripts[1];
+    tx.vout.resize(3);
+    tx.vout[0].nValue = 10;
+    tx.vout[0].scriptPubKey = included_scripts[1];
+    tx.vout[1].nValue = 10;
+    tx.vout[1].scriptPubKey = included_scripts[2];
+    // Empty outputs, as coinstakes start with, are left out
+    tx.vout[2].SetEmpty();
+
+    CBlock block;
+    block.vtx.push_back(CTransaction(coinbase));
+    block.vtx.push_back(CTransaction(tx));
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(20, included_scripts[3]), false, false, 1));
+
+    CBlockFilter blockfilter(block, blockundo);
+    BOOST_CHECK(blockfilter.GetBlockHash() == block.GetHash());
+
+    const CGCSFilter& filter = blockfilter.GetFilter();
+    BOOST_CHECK_EQUAL(filter.GetN(), 4U);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(filter.Match(CGCSFilter::Element(included_scripts[i].begin(), included_scripts[i].end())));
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(!filter.Match(CGCSFilter::Element(excluded_scripts[i].begin(), excluded_scripts[i].end())));
+
+    // Serialization round trip
+    CDataStream stream(SER_DISK, CLIENT_VERSION);
+    stream << blockfilter;
+    CBlockFilter blockfilter2;
+    stream >> blockfilter2;
+    BOOST_CHECK(blockfilter2.GetBlockHash() == blockfilter.GetBlockHash());
+    BOOST_CHECK(blockfilter2.GetEncodedFilter() == blockfilter.GetEncodedFilter());
+    BOOST_CHECK(blockfilter2.GetHash() == blockfilter.GetHash());
+
+    // Headers chain the filter hashes
+    uint256 header1 = blockfilter.ComputeHeader(uint256(0));
+    BOOST_CHECK(header1 != blockfilter.ComputeHeader(uint256(1)));
+    BOOST_CHECK(header1 == blockfilter2.ComputeHeader(uint256(0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,9 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
+#include "crypto/quark.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 
@@ -282,4 +285,109 @@ BOOST_AUTO_TEST_CASE(rfc6979_hmac_sha256)
             ("7597887cbd76321f32e30440679a22cf7f8d9d2eac390e581fea091ce202ba94"));
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Known answer: double-SHA256 of the bytes 0x00..0x3f.
+    unsigned char in[64];
+    for (int i = 0; i < 64; ++i)
+        in[i] = i;
+    unsigned char out[32];
+    SHA256D64(out, in, 1);
+    BOOST_CHECK(HexStr(out, out + 32) == "01c9f464780a1b6af4eb400fe2f2896cfb2169f5a65701439e4c2c4e213903ef");
+
+    // Every batch size must agree with the generic hasher, so the 8-way,
+    // 4-way and single block paths and their remainders are all exercised.
+    for (int blocks = 0; blocks <= 32; ++blocks) {
+        std::vector<unsigned char> vIn(64 * blocks + 1), vOut1(32 * blocks + 1), vOut2(32 * blocks + 1);
+        for (size_t i = 0; i < vIn.size(); ++i)
+            vIn[i] = insecure_rand() & 0xff;
+        for (int i = 0; i < blocks; ++i)
+            CHash256().Write(&vIn[64 * i], 64).Finalize(&vOut1[32 * i]);
+        SHA256D64(&vOut2[0], &vIn[0], blocks);
+        BOOST_CHECK(vOut1 == vOut2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quark_batch)
+{
+    // Random headers take both sides of each branch; batch sizes cover the
+    // 4-way kernels and their scalar remainders.
+    for (int blocks = 0; blocks <= 40; ++blocks) {
+        std::vector<unsigned char> vIn(80 * blocks + 1), vOut1(32 * blocks + 1), vOut2(32 * blocks + 1);
+        for (size_t i = 0; i < vIn.size(); ++i)
+            vIn[i] = insecure_rand() & 0xff;
+        for (int i = 0; i < blocks; ++i) {
+            uint256 hash = HashQuark(&vIn[80 * i], &vIn[80 * i + 80]);
+            memcpy(&vOut1[32 * i], hash.begin(), 32);
+        }
+        HashQuark80(&vOut2[0], &vIn[0], blocks);
+        BOOST_CHECK(vOut1 == vOut2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(muhash_num3072)
+{
+    // p - 1 is its own inverse, and squares to one; this exercises every reduction step
+    Num3072 minus_one;
+    minus_one.limbs[0] = ~(Num3072::limb_t)0 - 1103717;
+    for (int i = 1; i < Num3072::LIMBS; i++)
+        minus_one.limbs[i] = ~(Num3072::limb_t)0;
+    Num3072 x = minus_one;
+    x.Multiply(minus_one);
+    unsigned char one[Num3072::BYTE_SIZE] = {1};
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    x.ToBytes(bytes);
+    BOOST_CHECK(memcmp(bytes, one, sizeof(one)) == 0);
+
+    // A random number times its inverse
+    for (size_t i = 0; i < sizeof(bytes); i++)
+        bytes[i] = insecure_rand() & 0xff;
+    Num3072 a(bytes);
+    Num3072 b = a;
+    b.Invert();
+    b.Multiply(a);
+    b.ToBytes(bytes);
+    BOOST_CHECK(memcmp(bytes, one, sizeof(one)) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(muhash_set)
+{
+    const unsigned char elements[4][2] = {{0, 1}, {0, 2}, {1, 0}, {2, 0}};
+    uint256 hashEmpty, hash1, hash2;
+    CMuHash3072().Finalize(hashEmpty.begin());
+
+    // Order does not matter, and removing elements brings back the hash of the rest
+    CMuHash3072 set1, set2, set3;
+    for (int i = 0; i < 4; i++)
+        set1.Insert(elements[i], 2);
+    for (int i = 3; i >= 0; i--)
+        set2.Insert(elements[i], 2);
+    set1.Finalize(hash1.begin());
+    set2.Finalize(hash2.begin());
+    BOOST_CHECK(hash1 == hash2);
+    BOOST_CHECK(hash1 != hashEmpty);
+
+    set2.Remove(elements[3], 2).Remove(elements[1], 2);
+    set3.Insert(elements[2], 2).Insert(elements[0], 2);
+    set2.Finalize(hash1.begin());
+    set3.Finalize(hash2.begin());
+    BOOST_CHECK(hash1 == hash2);
+
+    // Disjoint sets combine; the state survives a round trip through bytes
+    CMuHash3072 set4;
+    set4.Insert(elements[1], 2).Insert(elements[3], 2);
+    set3 *= set4;
+    unsigned char state[CMuHash3072::STATE_SIZE];
+    set3.ToBytes(state);
+    CMuHash3072 set5;
+    set5.FromBytes(state);
+    set1.Finalize(hash1.begin());
+    set5.Finalize(hash2.begin());
+    BOOST_CHECK(hash1 == hash2);
+
+    set5.Remove(elements[0], 2).Remove(elements[1], 2).Remove(elements[2], 2).Remove(elements[3], 2);
+    set5.Finalize(hash2.begin());
+    BOOST_CHECK(hash2 == hashEmpty);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stake_kernel_preimage)
+{
+    uint256 hashTx = uint256("0x4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    unsigned int nPosition = 3;
+    CDataStream ssUniqueID(SER_NETWORK, 0);
+    ssUniqueID << nPosition << hashTx;
+    BOOST_CHECK_EQUAL(ssUniqueID.size(), STAKE_UNIQUENESS_SIZE);
+
+    uint64_t nStakeModifier = 0x0123456789abcdefULL;
+    unsigned int nTimeBlockFrom = 1546300800;
+    uint256 bnTarget;
+    bnTarget.SetCompact(0x1e0ffff0);
+
+    CStakeKernelPreimage preimage(nStakeModifier, nTimeBlockFrom, ssUniqueID);
+    for (unsigned int nTimeTx = nTimeBlockFrom + nStakeMinAge; nTimeTx < nTimeBlockFrom + nStakeMinAge + 30; nTimeTx++) {
+        uint256 hashStream, hashPreimage;
+        unsigned int nTryTime = nTimeTx;
+        bool fStream = CheckStake(ssUniqueID, 100 * COIN, nStakeModifier, bnTarget, nTimeBlockFrom, nTryTime, hashStream);
+        bool fPreimage = CheckStake(preimage, 100 * COIN, bnTarget, nTimeTx, hashPreimage);
+        BOOST_CHECK(hashStream == hashPreimage);
+        BOOST_CHECK_EQUAL(fStream, fPreimage);
+    }
+}
+
+// Chain walk GetKernelStakeModifier() used before the modifier index
+static const CBlockIndex* WalkKernelStakeModifier(const std::vector<CBlockIndex*>& vChain, const CBlockIndex* pindexFrom)
+{
+    int64_t nTimeTarget = pindexFrom->GetBlockTime() + GetStakeModifierSelectionInterval();
+    for (int nHeight = pindexFrom->nHeight + 1; nHeight < (int)vChain.size(); nHeight++) {
+        if (vChain[nHeight]->GeneratedStakeModifier() && vChain[nHeight]->GetBlockTime() >= nTimeTarget)
+            return vChain[nHeight];
+    }
+    return NULL;
+}
+
+static void ExtendChain(std::vector<CBlockIndex*>& vChain, std::vector<CBlockIndex>& vBlocks, int nLength)
+{
+    for (int i = 0; i < nLength; i++) {
+        CBlockIndex* pindexPrev = vChain.empty() ? NULL : vChain.back();
+        vBlocks.push_back(CBlockIndex());
+        CBlockIndex* pindex = &vBlocks.back();
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        // Roughly one minute spacing with timestamps allowed to run backwards
+        pindex->nTime = pindexPrev ? pindexPrev->nTime + 60 + (insecure_rand() % 600) - 300 : 1546300800;
+        pindex->SetStakeModifier(insecure_rand(), !pindexPrev || insecure_rand() % 3 == 0);
+        pindex->BuildSkip();
+        vChain.push_back(pindex);
+    }
+}
+
+static void CheckKernelStakeModifiers(const std::vector<CBlockIndex*>& vChain)
+{
+    for (size_t i = 0; i < vChain.size(); i++) {
+        uint64_t nStakeModifier;
+        int nStakeModifierHeight;
+        int64_t nStakeModifierTime;
+        bool fFound = GetKernelStakeModifier(vChain[i], nStakeModifier, nStakeModifierHeight, nStakeModifierTime);
+        const CBlockIndex* pindexExpected = WalkKernelStakeModifier(vChain, vChain[i]);
+        BOOST_CHECK_EQUAL(fFound, pindexExpected != NULL);
+        if (fFound && pindexExpected) {
+            BOOST_CHECK_EQUAL(nStakeModifierHeight, pindexExpected->nHeight);
+            BOOST_CHECK_EQUAL(nStakeModifierTime, pindexExpected->GetBlockTime());
+            BOOST_CHECK_EQUAL(nStakeModifier, pindexExpected->nStakeModifier);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index)
+{
+    std::vector<CBlockIndex> vBlocks;
+    vBlocks.reserve(3000);
+
+    std::vector<CBlockIndex*> vChain;
+    ExtendChain(vChain, vBlocks, 1000);
+    UpdateStakeModifierIndex(vChain.back());
+    CheckKernelStakeModifiers(vChain);
+
+    // Reorganize onto a fork: only the tail of the index may change
+    std::vector<CBlockIndex*> vFork(vChain.begin(), vChain.begin() + 700);
+    ExtendChain(vFork, vBlocks, 500);
+    UpdateStakeModifierIndex(vFork.back());
+    CheckKernelStakeModifiers(vFork);
+
+    // Disconnect a few blocks, then connect them again one at a time
+    UpdateStakeModifierIndex(vFork[1100]);
+    CheckKernelStakeModifiers(std::vector<CBlockIndex*>(vFork.begin(), vFork.begin() + 1101));
+    for (size_t i = 1101; i < vFork.size(); i++)
+        UpdateStakeModifierIndex(vFork[i]);
+    CheckKernelStakeModifiers(vFork);
+
+    LOCK(cs_main);
+    UpdateStakeModifierIndex(chainActive.Tip());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,142 @@
+// Copyright (c) 2019 The Mktcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "random.h"
+
+#include <algorithm>
+#include <list>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+static std::list<uint256> listRankHashes;
+static std::vector<CBlockIndex*> vRankBlocks;
+
+static CBlockIndex* add_block(CBlockIndex* pprev)
+{
+    listRankHashes.push_back(GetRandHash());
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->phashBlock = &listRankHashes.back();
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev->nHeight + 1;
+    pindex->BuildSkip();
+    vRankBlocks.push_back(pindex);
+    chainActive.SetTip(pindex);
+    return pindex;
+}
+
+// Disconnect the tip the way DisconnectTip does
+static void disconnect_block()
+{
+    CBlockIndex* pindexDelete = chainActive.Tip();
+    chainActive.SetTip(pindexDelete->pprev);
+    ForgetBlockHashes(pindexDelete->nHeight);
+}
+
+static CMasternode make_masternode(bool fPinged)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(GetRandHash(), 0));
+    mn.sigTime = GetAdjustedTime() - 2 * MASTERNODE_REMOVAL_SECONDS;
+    mn.unitTest = true;
+    if (fPinged) {
+        mn.lastPing.vin = mn.vin;
+        mn.lastPing.blockHash = GetRandHash();
+        mn.lastPing.sigTime = GetAdjustedTime();
+    }
+    return mn;
+}
+
+struct CompareFreshScore {
+    uint256 hashBlock;
+    bool operator()(const CMasternode& a, const CMasternode& b) const
+    {
+        return a.CalculateScore(hashBlock) > b.CalculateScore(hashBlock);
+    }
+};
+
+// Rank the masternodes from scratch, scoring against the block below nBlockHeight on the active chain
+static void check_ranks(CMasternodeMan& man, std::vector<CMasternode> vExpected, int nBlockHeight)
+{
+    CompareFreshScore cmp;
+    cmp.hashBlock = chainActive[nBlockHeight - 1]->GetBlockHash();
+    std::sort(vExpected.begin(), vExpected.end(), cmp);
+
+    BOOST_CHECK_EQUAL(man.size(), (int)vExpected.size());
+    for (unsigned int i = 0; i < vExpected.size(); i++) {
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vExpected[i].vin, nBlockHeight, 0, false), (int)i + 1);
+        CMasternode* pmn = man.GetMasternodeByRank(i + 1, nBlockHeight, 0, false);
+        BOOST_CHECK(pmn != NULL && pmn->vin == vExpected[i].vin);
+    }
+    BOOST_CHECK(man.GetMasternodeByRank(vExpected.size() + 1, nBlockHeight, 0, false) == NULL);
+}
+
+static void check_heights(CMasternodeMan& man, const std::vector<CMasternode>& vExpected)
+{
+    // Twice, so the second pass is answered from the cached tables
+    for (int nPass = 0; nPass < 2; nPass++)
+        for (int nHeight = 2; nHeight <= chainActive.Height() + 1; nHeight++)
+            check_ranks(man, vExpected, nHeight);
+}
+
+BOOST_AUTO_TEST_CASE(rank_cache_tests)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexStart = chainActive.Tip();
+    ForgetBlockHashes(0);
+    for (int i = 0; i < 10; i++)
+        add_block(chainActive.Tip());
+
+    CMasternodeMan man;
+    std::vector<CMasternode> vExpected;
+    for (int i = 0; i < 8; i++) {
+        CMasternode mn = make_masternode(i % 2 == 0);
+        BOOST_CHECK(man.Add(mn));
+        vExpected.push_back(mn);
+    }
+    check_heights(man, vExpected);
+
+    // Add
+    CMasternode mnAdded = make_masternode(true);
+    BOOST_CHECK(man.Add(mnAdded));
+    vExpected.push_back(mnAdded);
+    check_heights(man, vExpected);
+
+    // Remove
+    man.Remove(vExpected[2].vin);
+    vExpected.erase(vExpected.begin() + 2);
+    check_heights(man, vExpected);
+
+    // CheckAndRemove drops the masternodes that never pinged
+    man.CheckAndRemove();
+    std::vector<CMasternode> vPinged;
+    BOOST_FOREACH (const CMasternode& mn, vExpected)
+        if (mn.lastPing != CMasternodePing())
+            vPinged.push_back(mn);
+    vExpected.swap(vPinged);
+    BOOST_CHECK_EQUAL(vExpected.size(), 4U);
+    check_heights(man, vExpected);
+
+    // Reorganize the top blocks away; the heights above the fork must be scored against the new blocks
+    for (int i = 0; i < 4; i++)
+        disconnect_block();
+    for (int i = 0; i < 5; i++)
+        add_block(chainActive.Tip());
+    check_heights(man, vExpected);
+
+    chainActive.SetTip(pindexStart);
+    ForgetBlockHashes(0);
+    BOOST_FOREACH (CBlockIndex* pindex, vRankBlocks)
+        delete pindex;
+    vRankBlocks.clear();
+    listRankHashes.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "miner.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -58,17 +60,17 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(removed.size(), 0);
 
     // Just the parent:
-    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1, 1));
     testPool.remove(txParent, removed, true);
     BOOST_CHECK_EQUAL(removed.size(), 1);
     removed.clear();
     
     // Parent, children, grandchildren:
-    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1, 1));
     for (int i = 0; i < 3; i++)
     {
-        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1));
-        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1));
+        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1, 1));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1, 1));
     }
     // Remove Child[0], GrandChild[0] should be removed:
     testPool.remove(txChild[0], removed, true);
@@ -88,8 +90,8 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     // Add children and grandchildren, but NOT the parent (simulate the parent being in a block)
     for (int i = 0; i < 3; i++)
     {
-        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1));
-        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1));
+        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1, 1));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1, 1));
     }
     // Now remove the parent, as might happen if a block-re-org occurs but the parent cannot be
     // put into the mempool (maybe because it is non-standard):
@@ -99,4 +101,262 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+static CMutableTransaction MempoolTestTx(const uint256& hashPrev, uint32_t nOut, unsigned int nOutputs, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = nOut;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // parent <- child <- grandchild
+    CMutableTransaction txParent = MempoolTestTx(GetRandHash(), 0, 2, 10 * COIN);
+    CMutableTransaction txChild = MempoolTestTx(txParent.GetHash(), 0, 1, 9 * COIN);
+    CMutableTransaction txGrandChild = MempoolTestTx(txChild.GetHash(), 0, 1, 8 * COIN);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0.0, 1, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 4000, 0, 0.0, 1, 1));
+
+    CTxMemPool::txiter parent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter child = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter grandchild = pool.mapTx.find(txGrandChild.GetHash());
+    uint64_t nChainSize = parent->GetTxSize() + child->GetTxSize() + grandchild->GetTxSize();
+
+    BOOST_CHECK_EQUAL(parent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(parent->GetSizeWithDescendants(), nChainSize);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(child->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(grandchild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandchild->GetSizeWithAncestors(), nChainSize);
+    BOOST_CHECK_EQUAL(grandchild->GetModFeesWithAncestors(), 7000);
+    BOOST_CHECK(pool.GetMemPoolChildren(parent).count(child));
+    BOOST_CHECK(pool.GetMemPoolParents(grandchild).count(child));
+
+    // Ancestor limits are enforced on new entries
+    CMutableTransaction txGreat = MempoolTestTx(txGrandChild.GetHash(), 0, 1, 7 * COIN);
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(CTxMemPoolEntry(txGreat, 0, 0, 0.0, 1, 1), setAncestors, 3, 1000000, 25, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(CTxMemPoolEntry(txGreat, 0, 0, 0.0, 1, 1), setAncestors, 4, 1000000, 25, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+
+    // Prioritisation is reflected in both directions
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 7500);
+    BOOST_CHECK_EQUAL(grandchild->GetModFeesWithAncestors(), 7500);
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0.0, -500);
+
+    // Confirming the parent leaves the rest of the chain consistent
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(child->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(grandchild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandchild->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK(pool.GetMemPoolParents(child).empty());
+
+    // Resurrecting it as in a reorg relinks the existing children
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1, 1));
+    pool.UpdateTransactionsFromBlock(std::vector<uint256>(1, txParent.GetHash()));
+    parent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(parent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(grandchild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandchild->GetModFeesWithAncestors(), 7000);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three unrelated transactions of (nearly) equal size and increasing fee,
+    // plus a zero fee parent of a high fee child.
+    CMutableTransaction tx1 = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction tx2 = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction tx3 = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction txLow = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction txHigh = MempoolTestTx(txLow.GetHash(), 0, 1, 9 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000, 3, 0.0, 1, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 2000, 1, 0.0, 1, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 3000, 2, 0.0, 1, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 0, 4, 0.0, 1, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 20000, 5, 0.0, 1, 1));
+
+    // Mining score only looks at the transaction itself
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator mi = pool.mapTx.get<mining_score>().begin();
+    BOOST_CHECK(mi++->GetTx().GetHash() == txHigh.GetHash());
+    BOOST_CHECK(mi++->GetTx().GetHash() == tx3.GetHash());
+    BOOST_CHECK(mi++->GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(mi++->GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(mi++->GetTx().GetHash() == txLow.GetHash());
+
+    // The ancestor score lets the child's fee pull it ahead, after its parent
+    // has been accounted for; the parent itself still sorts last.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ai = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ai++->GetTx().GetHash() == txHigh.GetHash());
+    BOOST_CHECK(ai++->GetTx().GetHash() == tx3.GetHash());
+    BOOST_CHECK(ai++->GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(ai++->GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(ai++->GetTx().GetHash() == txLow.GetHash());
+
+    // Descendant score (eviction order, worst first) rates the parent by its package
+    CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator di = pool.mapTx.get<descendant_score>().begin();
+    BOOST_CHECK(di++->GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(di++->GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(di++->GetTx().GetHash() == tx3.GetHash());
+    BOOST_CHECK(di++->GetTx().GetHash() == txLow.GetHash());
+    BOOST_CHECK(di++->GetTx().GetHash() == txHigh.GetHash());
+
+    // Entry time
+    CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator ti = pool.mapTx.get<entry_time>().begin();
+    BOOST_CHECK(ti++->GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(ti++->GetTx().GetHash() == tx3.GetHash());
+    BOOST_CHECK(ti++->GetTx().GetHash() == tx1.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction tx2 = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction txLow = MempoolTestTx(GetRandHash(), 0, 1, 10 * COIN);
+    CMutableTransaction txHigh = MempoolTestTx(txLow.GetHash(), 0, 1, 9 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 10, 0.0, 1, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000, 20, 0.0, 1, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 0, 30, 0.0, 1, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 20000, 40, 0.0, 1, 1));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Nothing to evict while under the limit
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // tx2 has the lowest descendant feerate; the zero fee parent is carried
+    // by its child.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(txLow.GetHash()));
+    CFeeRate minFee = pool.GetMinFee(1);
+    BOOST_CHECK_EQUAL(minFee.GetFeePerK(), CFeeRate(5000, ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION)).GetFeePerK() + 1000);
+
+    // Evicting the package removes the parent together with its child
+    std::list<CTransaction> removed;
+    pool.remove(tx1, removed, false);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    // Expire removes old entries along with their descendants
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 10, 0.0, 1, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 0, 30, 0.0, 1, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 20000, 50, 0.0, 1, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(31), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 10, 0.0, 1, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 0, 30, 0.0, 1, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(20), 1);
+    BOOST_CHECK(pool.exists(txLow.GetHash()));
+}
+
+// Check the selection kept up to date as entries come and go against one built from scratch
+static void CheckTemplateCache(CTxMemPool& pool, CBlockTemplateCache& cache, const uint256& hashPrevBlock, int nHeight)
+{
+    LOCK(pool.cs);
+    std::vector<CTxMemPool::txiter> vCached, vFresh;
+    cache.GetSelection(hashPrevBlock, nHeight, vCached);
+    CBlockTemplateCache fresh(pool);
+    fresh.GetSelection(hashPrevBlock, nHeight, vFresh);
+
+    std::set<uint256> setCached, setFresh;
+    CAmount nCachedFees = 0, nFreshFees = 0;
+    unsigned int nCachedSigOps = 0, nFreshSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter iter, vCached) {
+        // Parents always come first
+        BOOST_FOREACH (CTxMemPool::txiter parent, pool.GetMemPoolParents(iter))
+            BOOST_CHECK(setCached.count(parent->GetTx().GetHash()));
+        BOOST_CHECK(setCached.insert(iter->GetTx().GetHash()).second);
+        nCachedFees += iter->GetFee();
+        nCachedSigOps += iter->GetSigOpCount();
+    }
+    BOOST_FOREACH (CTxMemPool::txiter iter, vFresh) {
+        setFresh.insert(iter->GetTx().GetHash());
+        nFreshFees += iter->GetFee();
+        nFreshSigOps += iter->GetSigOpCount();
+    }
+    BOOST_CHECK(setCached == setFresh);
+    BOOST_CHECK_EQUAL(nCachedFees, nFreshFees);
+    BOOST_CHECK_EQUAL(nCachedSigOps, nFreshSigOps);
+}
+
+BOOST_AUTO_TEST_CASE(BlockTemplateCacheTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlockTemplateCache cache(pool);
+    uint256 hashPrevBlock = GetRandHash();
+    int nHeight = 100;
+    std::vector<COutPoint> vUnspent;
+
+    for (int i = 0; i < 400; i++) {
+        int nAction = insecure_rand() % 10;
+        if (nAction < 6 || pool.size() == 0) {
+            // Spend a confirmed coin or an output of a pool entry
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            if (vUnspent.empty() || insecure_rand() % 2) {
+                tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            } else {
+                // Outputs of entries removed since count as confirmed
+                size_t nPos = insecure_rand() % vUnspent.size();
+                tx.vin[0].prevout = vUnspent[nPos];
+                vUnspent.erase(vUnspent.begin() + nPos);
+            }
+            tx.vin[0].scriptSig = CScript() << OP_1;
+            tx.vout.resize(2);
+            tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+            tx.vout[0].nValue = 1000;
+            tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+            tx.vout[1].nValue = 1000;
+            uint256 hash = tx.GetHash();
+            CAmount nFee = (insecure_rand() % 5) * 1000;
+            double dPriority = insecure_rand() % 4 == 0 ? 1e10 : 0.0;
+            pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, GetTime(), dPriority, nHeight, 1 + insecure_rand() % 20));
+            vUnspent.push_back(COutPoint(hash, 0));
+            vUnspent.push_back(COutPoint(hash, 1));
+        } else if (nAction < 8) {
+            // Remove an entry and its descendants, as a block or a conflict would
+            CTxMemPool::indexed_transaction_set::iterator it = pool.mapTx.begin();
+            std::advance(it, insecure_rand() % pool.size());
+            CTransaction tx = it->GetTx();
+            std::list<CTransaction> removed;
+            pool.remove(tx, removed, true);
+        } else if (nAction < 9) {
+            CTxMemPool::indexed_transaction_set::iterator it = pool.mapTx.begin();
+            std::advance(it, insecure_rand() % pool.size());
+            uint256 hash = it->GetTx().GetHash();
+            pool.PrioritiseTransaction(hash, hash.ToString(), 0.0, 10000);
+        } else {
+            // A new tip
+            hashPrevBlock = GetRandHash();
+            nHeight++;
+        }
+        CheckTemplateCache(pool, cache, hashPrevBlock, nHeight);
+    }
+    pool.clear();
+    CheckTemplateCache(pool, cache, hashPrevBlock, nHeight);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
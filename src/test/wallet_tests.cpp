@@ -4,6 +4,10 @@
 
 #include "wallet.h"
 
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -305,4 +309,117 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+// Blocks on top of the current tip, indexed only as far as the wallet looks at them
+static std::vector<CBlockIndex*> vBalanceBlocks;
+
+static CBlockIndex* add_block(CWallet& wallet, CBlockIndex* pprev, const CTransaction* ptx = NULL)
+{
+    static unsigned int nNonce = 0;
+    CBlock block;
+    block.hashPrevBlock = pprev->GetBlockHash();
+    block.nNonce = ++nNonce;
+    if (ptx)
+        block.vtx.push_back(*ptx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockIndex* pindex = new CBlockIndex(block);
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev->nHeight + 1;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->BuildSkip();
+    vBalanceBlocks.push_back(pindex);
+    chainActive.SetTip(pindex);
+
+    if (ptx)
+        wallet.SyncTransaction(*ptx, &block);
+    return pindex;
+}
+
+static void check_balances(const CWallet& wallet)
+{
+    BOOST_CHECK(wallet.GetBalances() == wallet.GetBalancesFullScan());
+}
+
+BOOST_AUTO_TEST_CASE(cached_balances_tests)
+{
+    LOCK(cs_main);
+    CWallet walletBalances("wallet_balances.dat");
+    bool fFirstRun;
+    walletBalances.LoadWallet(fFirstRun);
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(walletBalances.AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_TRUE;
+    CBlockIndex* pindexStart = chainActive.Tip();
+
+    // A generated coin, immature
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    coinbase.vout.push_back(CTxOut(50 * COIN, scriptMine));
+    CTransaction txCoinbase(coinbase);
+    add_block(walletBalances, pindexStart, &txCoinbase);
+    check_balances(walletBalances);
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 0);
+
+    // A payment, then a spend of it that changes the prevout's share
+    CMutableTransaction receive;
+    receive.vin.resize(1);
+    receive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    receive.vout.push_back(CTxOut(10 * COIN, scriptMine));
+    receive.vout.push_back(CTxOut(5 * COIN, scriptMine));
+    CTransaction txReceive(receive);
+    add_block(walletBalances, chainActive.Tip(), &txReceive);
+    check_balances(walletBalances);
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 15 * COIN);
+
+    CBlockIndex* pindexFork = chainActive.Tip();
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(txReceive.GetHash(), 0);
+    spend.vout.push_back(CTxOut(10 * COIN, scriptOther));
+    CTransaction txSpend(spend);
+    add_block(walletBalances, chainActive.Tip(), &txSpend);
+    check_balances(walletBalances);
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 5 * COIN);
+
+    // Locking and unlocking a coin
+    {
+        LOCK(walletBalances.cs_wallet);
+        COutPoint outpoint(txReceive.GetHash(), 1);
+        walletBalances.LockCoin(outpoint);
+        check_balances(walletBalances);
+        walletBalances.UnlockCoin(outpoint);
+        check_balances(walletBalances);
+        walletBalances.LockCoin(outpoint);
+        walletBalances.UnlockAllCoins();
+        check_balances(walletBalances);
+    }
+
+    // The generated coin matures one block at a time
+    for (int i = 0; i <= Params().COINBASE_MATURITY(); i++) {
+        add_block(walletBalances, chainActive.Tip());
+        check_balances(walletBalances);
+    }
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 55 * COIN);
+
+    // A reorg drops the spend, and the coin it spent is available again
+    CBlockIndex* pindex = pindexFork;
+    for (int i = 0; i <= Params().COINBASE_MATURITY() + 1; i++)
+        pindex = add_block(walletBalances, pindex);
+    walletBalances.SyncTransaction(txSpend, NULL);
+    check_balances(walletBalances);
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 65 * COIN);
+
+    chainActive.SetTip(pindexStart);
+    BOOST_FOREACH (CBlockIndex* pindexBalance, vBalanceBlocks) {
+        mapBlockIndex.erase(pindexBalance->GetBlockHash());
+        delete pindexBalance;
+    }
+    vBalanceBlocks.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
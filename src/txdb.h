@@ -7,6 +7,8 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
+#include "blockfilter.h"
 #include "leveldbwrapper.h"
 #include "main.h"
 
@@ -15,7 +17,6 @@
 #include <utility>
 #include <vector>
 
-class CCoins;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -34,11 +35,15 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
+    //! Only reads mapCoins, see CCoinsViewFlushQueue
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Convert the per-transaction records of older versions to per-output ones
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -65,6 +70,20 @@ public:
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
     bool ReadInt(const std::string& name, int& nValue);
+    //! Running UTXO set statistics, valid for the chainstate at stats.hashBlock
+    bool WriteCoinsStats(const CCoinsStats& stats);
+    bool ReadCoinsStats(CCoinsStats& stats);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    //! Balance changes of an address, in block order, between the given heights (0 = unbounded)
+    bool ReadAddressIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start = 0, int end = 0);
+    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect);
+    bool ReadAddressUnspentIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect);
+    bool ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+    bool WriteBlockFilter(const CBlockFilter& filter, const uint256& header);
+    bool ReadBlockFilter(const uint256& hash, CBlockFilter& filter);
+    bool ReadBlockFilterHeader(const uint256& hash, uint256& header);
     bool LoadBlockIndexGuts();
 };
 
@@ -8,6 +8,7 @@
 
 #include "wallet.h"
 #include "base58.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "kernel.h"
@@ -42,6 +43,7 @@ bool bSpendZeroConfChange = true;
 bool bdisableSystemnotifications = false; // Those bubbles can be annoying and slow down the UI when you get lots of trx
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+bool fCheckBalances = false;
 int64_t nStartupTime = GetTime(); //!< Client startup time for use with automint
 
 /**
@@ -646,6 +648,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
+        fBalancesLoaded = false;
+        fWalletOutputsLoaded = false;
     }
 }
 
@@ -704,6 +708,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkStakeCandidatesDirty(wtx);
+        MarkBalancesDirty(wtx);
+        MarkWalletOutputsDirty(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -758,6 +765,11 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    ++nTipUpdates;
+}
+
 void CWallet::EraseFromWallet(const uint256& hash)
 {
     if (!fFileBacked)
@@ -766,6 +778,9 @@ void CWallet::EraseFromWallet(const uint256& hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        setStakeCandidatesDirty.insert(hash);
+        setBalancesDirty.insert(hash);
+        setWalletOutputsDirty.insert(hash);
     }
     return;
 }
@@ -1452,48 +1467,315 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+namespace
+{
+//! Blocks committed to the wallet under one lock during a rescan
+const size_t RESCAN_COMMIT_BATCH = 16;
+//! Blocks read ahead of the committer
+const size_t RESCAN_READ_AHEAD = 4 * RESCAN_COMMIT_BATCH;
+
+/** Copy of the wallet's keys and scripts, so that rescan threads can match outputs without cs_KeyStore */
+class CRescanKeyStore : public CKeyStore
+{
+public:
+    std::set<CKeyID> setKeys;
+    ScriptMap mapScripts;
+    WatchOnlySet setWatchOnly;
+    MultiSigScriptSet setMultiSig;
+
+    bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey) { return false; }
+    bool HaveKey(const CKeyID& address) const { return setKeys.count(address) > 0; }
+    bool GetKey(const CKeyID& address, CKey& keyOut) const { return false; }
+    void GetKeys(std::set<CKeyID>& setAddress) const { setAddress = setKeys; }
+
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID& hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID& hash, CScript& redeemScriptOut) const
+    {
+        ScriptMap::const_iterator mi = mapScripts.find(hash);
+        if (mi == mapScripts.end())
+            return false;
+        redeemScriptOut = mi->second;
+        return true;
+    }
+
+    bool AddWatchOnly(const CScript& dest) { return false; }
+    bool RemoveWatchOnly(const CScript& dest) { return false; }
+    bool HaveWatchOnly(const CScript& dest) const { return setWatchOnly.count(dest) > 0; }
+    bool HaveWatchOnly() const { return !setWatchOnly.empty(); }
+
+    bool AddMultiSig(const CScript& dest) { return false; }
+    bool RemoveMultiSig(const CScript& dest) { return false; }
+    bool HaveMultiSig(const CScript& dest) const { return setMultiSig.count(dest) > 0; }
+    bool HaveMultiSig() const { return !setMultiSig.empty(); }
+};
+
+/** A block read for the rescan, with the txs that pay to the wallet flagged */
+struct CRescanBlock {
+    CBlock block;
+    std::vector<char> vMatch;
+    bool fDone;
+
+    CRescanBlock() : fDone(false) {}
+};
+
+/**
+ * Reads the blocks of a rescan on a pool of threads and flags the txs with
+ * an output matching the key snapshot. The committer takes the blocks in
+ * chain order; readers stay at most RESCAN_READ_AHEAD blocks ahead of it.
+ * The readers are stopped and joined when the pipeline goes out of scope.
+ *
+ * Blocks are read from disk positions taken under cs_main, as pruning may
+ * change the index entries meanwhile. With -blockfilterindex, blocks whose
+ * filter matches none of the wallet's scripts are not read at all and
+ * reach the committer empty.
+ */
+class CRescanPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    boost::condition_variable condSpace;
+    const std::vector<CBlockIndex*>& vIndex;
+    const std::vector<CDiskBlockPos>& vPos;
+    const CKeyStore& keystore;
+    const CGCSFilter::ElementSet* pScripts;
+    std::vector<CRescanBlock> vSlots;
+    size_t nNext;
+    size_t nReleased;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Thread()
+    {
+        RenameThread("mktcash-rescan");
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNext < vIndex.size() && nNext >= nReleased + RESCAN_READ_AHEAD)
+                    condSpace.wait(lock);
+                if (fStop || nNext >= vIndex.size())
+                    return;
+                i = nNext++;
+            }
+
+            // The slot is ours until it is marked done
+            CRescanBlock& slot = vSlots[i % RESCAN_READ_AHEAD];
+            CBlockFilter filter;
+            if (pScripts && pblocktree->ReadBlockFilter(vIndex[i]->GetBlockHash(), filter) && !filter.GetFilter().MatchAny(*pScripts)) {
+                slot.block.SetNull();
+                nFiltered++;
+            } else if (vPos[i].IsNull() || !ReadBlockFromDisk(slot.block, vPos[i]) || slot.block.GetHash() != vIndex[i]->GetBlockHash())
+                slot.block.SetNull();
+            slot.vMatch.assign(slot.block.vtx.size(), false);
+            for (unsigned int n = 0; n < slot.block.vtx.size(); n++) {
+                BOOST_FOREACH (const CTxOut& txout, slot.block.vtx[n].vout) {
+                    if (::IsMine(keystore, txout.scriptPubKey) != ISMINE_NO) {
+                        slot.vMatch[n] = true;
+                        break;
+                    }
+                }
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                slot.fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+public:
+    std::atomic<size_t> nFiltered;
+
+    CRescanPipeline(const std::vector<CBlockIndex*>& vIndexIn, const std::vector<CDiskBlockPos>& vPosIn, const CKeyStore& keystoreIn, const CGCSFilter::ElementSet* pScriptsIn, int nThreads)
+        : vIndex(vIndexIn), vPos(vPosIn), keystore(keystoreIn), pScripts(pScriptsIn), vSlots(RESCAN_READ_AHEAD), nNext(0), nReleased(0), fStop(false), nFiltered(0)
+    {
+        for (int n = 0; n < nThreads; n++)
+            threadGroup.create_thread(boost::bind(&CRescanPipeline::Thread, this));
+    }
+
+    ~CRescanPipeline() { Stop(); }
+
+    CRescanBlock& Wait(size_t i)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CRescanBlock& slot = vSlots[i % RESCAN_READ_AHEAD];
+        while (!slot.fDone)
+            condDone.wait(lock);
+        return slot;
+    }
+
+    //! Hand the slots of all blocks before nEnd back to the readers
+    void Release(size_t nEnd)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (size_t i = nReleased; i < nEnd; i++) {
+                CRescanBlock& slot = vSlots[i % RESCAN_READ_AHEAD];
+                slot.block.SetNull();
+                slot.fDone = false;
+            }
+            nReleased = nEnd;
+        }
+        condSpace.notify_all();
+    }
+
+    //! Stop the readers and wait for them to exit
+    void Stop()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condSpace.notify_all();
+        threadGroup.join_all();
+    }
+};
+} // namespace
+
+bool CWallet::ReserveRescan()
+{
+    bool fExpected = false;
+    if (!fScanningWallet.compare_exchange_strong(fExpected, true))
+        return false;
+    fAbortRescan = false;
+    nScanStartTime = GetTimeMillis();
+    dScanProgress = 0;
+    return true;
+}
+
 /**
- * Scan the block chain (starting in pindexStart) for transactions
- * from or to us. If fUpdate is true, found transactions that already
- * exist in the wallet will be updated.
+ * Scan the active chain from pindexStart for wallet transactions.
+ *
+ * Blocks are read and matched against a snapshot of the keystore on
+ * MAX_RESCAN_THREADS threads, and committed in chain order in batches, so
+ * that cs_main and cs_wallet are only held while a batch is added. Blocks
+ * connected while scanning are picked up by a further pass, after the txs
+ * they may spend from are in the wallet. AbortRescan() stops the scan after
+ * the current batch. The caller must hold the rescan slot through reserver.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate)
 {
+    assert(reserver.IsReserved());
+
     int ret = 0;
     int64_t nNow = GetTime();
 
+    CRescanKeyStore keystore;
+    CGCSFilter::ElementSet setScripts;
+    {
+        LOCK(cs_KeyStore);
+        GetKeys(keystore.setKeys);
+        keystore.mapScripts = mapScripts;
+        keystore.setWatchOnly = setWatchOnly;
+        keystore.setMultiSig = setMultiSig;
+
+        // The output scripts the block filters are tested against. Bare
+        // multisig outputs to the wallet's keys are only found if added
+        // with AddMultiSig, as they cannot be derived from the keys.
+        if (fBlockFilterIndex) {
+            std::vector<CScript> vScripts;
+            BOOST_FOREACH (const CKeyID& keyID, keystore.setKeys) {
+                CPubKey pubkey;
+                if (GetPubKey(keyID, pubkey))
+                    vScripts.push_back(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+                vScripts.push_back(GetScriptForDestination(keyID));
+            }
+            for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); it++)
+                vScripts.push_back(GetScriptForDestination(it->first));
+            vScripts.insert(vScripts.end(), setWatchOnly.begin(), setWatchOnly.end());
+            vScripts.insert(vScripts.end(), setMultiSig.begin(), setMultiSig.end());
+            BOOST_FOREACH (const CScript& script, vScripts)
+                setScripts.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart;
+    double dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_main);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        set<uint256> setAddedToWallet;
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    int nLastProgress = 0;
+    int nScannedHeight = -1;
+    while (pindex && !fAbortRescan) {
+        std::vector<CBlockIndex*> vIndex;
+        std::vector<CDiskBlockPos> vPos;
+        {
+            LOCK(cs_main);
+            for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan)) {
+                vIndex.push_back(pindexScan);
+                vPos.push_back((pindexScan->nStatus & BLOCK_HAVE_DATA) ? pindexScan->GetBlockPos() : CDiskBlockPos());
             }
+        }
 
-            pindex = chainActive.Next(pindex);
+        CRescanPipeline pipeline(vIndex, vPos, keystore, fBlockFilterIndex ? &setScripts : NULL, nThreads);
+
+        for (size_t i = 0; i < vIndex.size() && !fAbortRescan && !ShutdownRequested(); i += RESCAN_COMMIT_BATCH) {
+            size_t nEnd = std::min(vIndex.size(), i + RESCAN_COMMIT_BATCH);
+            for (size_t n = i; n < nEnd; n++)
+                pipeline.Wait(n);
+
+            {
+                LOCK2(cs_main, cs_wallet);
+                for (size_t n = i; n < nEnd; n++) {
+                    // Blocks reorganized away meanwhile are replaced in the next pass
+                    if (!chainActive.Contains(vIndex[n]))
+                        continue;
+
+                    CRescanBlock& rescanBlock = pipeline.Wait(n);
+                    for (unsigned int k = 0; k < rescanBlock.block.vtx.size(); k++) {
+                        const CTransaction& tx = rescanBlock.block.vtx[k];
+                        bool fCandidate = rescanBlock.vMatch[k] || mapWallet.count(tx.GetHash());
+                        for (unsigned int m = 0; m < tx.vin.size() && !fCandidate; m++)
+                            fCandidate = mapWallet.count(tx.vin[m].prevout.hash) > 0;
+                        if (fCandidate && AddToWalletIfInvolvingMe(tx, &rescanBlock.block, fUpdate))
+                            ret++;
+                    }
+                }
+            }
+            pipeline.Release(nEnd);
+
+            CBlockIndex* pindexLast = vIndex[nEnd - 1];
+            nScannedHeight = pindexLast->nHeight;
+            if (dProgressTip - dProgressStart > 0.0)
+                dScanProgress = std::max(0.0, std::min(1.0, (Checkpoints::GuessVerificationProgress(pindexLast, false) - dProgressStart) / (dProgressTip - dProgressStart)));
+            if ((int)(dScanProgress * 100) != nLastProgress) {
+                nLastProgress = (int)(dScanProgress * 100);
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, nLastProgress)));
+            }
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexLast->nHeight, Checkpoints::GuessVerificationProgress(pindexLast));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        pipeline.Stop();
+        if (pipeline.nFiltered > 0)
+            LogPrint("wallet", "%s : skipped %u of %u blocks by their filter\n", __func__, (size_t)pipeline.nFiltered, vIndex.size());
+        if (ShutdownRequested())
+            fAbortRescan = true;
+
+        LOCK(cs_main);
+        pindex = chainActive.Next(chainActive.FindFork(vIndex.back()));
     }
+
+    if (fAbortRescan)
+        LogPrintf("Rescan aborted after block %d\n", nScannedHeight);
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1600,94 +1882,254 @@ void CWallet::ResendWalletTransactions()
  * @{
  */
 
-CAmount CWallet::GetBalance() const
+void CWalletBalances::SetNull()
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+    nBalance = 0;
+    nUnconfirmed = 0;
+    nImmature = 0;
+    nWatchOnly = 0;
+    nUnconfirmedWatchOnly = 0;
+    nImmatureWatchOnly = 0;
+    nLocked = 0;
+    nUnlocked = 0;
+    nLockedWatchOnly = 0;
+    nAnonymizable = 0;
+    nAnonymized = 0;
+    nDenominatedConf = 0;
+    nDenominatedUnconf = 0;
+}
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
+bool CWalletBalances::IsNull() const
+{
+    return *this == CWalletBalances();
+}
 
-    return nTotal;
+CWalletBalances& CWalletBalances::operator+=(const CWalletBalances& other)
+{
+    nBalance += other.nBalance;
+    nUnconfirmed += other.nUnconfirmed;
+    nImmature += other.nImmature;
+    nWatchOnly += other.nWatchOnly;
+    nUnconfirmedWatchOnly += other.nUnconfirmedWatchOnly;
+    nImmatureWatchOnly += other.nImmatureWatchOnly;
+    nLocked += other.nLocked;
+    nUnlocked += other.nUnlocked;
+    nLockedWatchOnly += other.nLockedWatchOnly;
+    nAnonymizable += other.nAnonymizable;
+    nAnonymized += other.nAnonymized;
+    nDenominatedConf += other.nDenominatedConf;
+    nDenominatedUnconf += other.nDenominatedUnconf;
+    return *this;
 }
 
-int nLastMaturityCheck = 0;
+CWalletBalances& CWalletBalances::operator-=(const CWalletBalances& other)
+{
+    nBalance -= other.nBalance;
+    nUnconfirmed -= other.nUnconfirmed;
+    nImmature -= other.nImmature;
+    nWatchOnly -= other.nWatchOnly;
+    nUnconfirmedWatchOnly -= other.nUnconfirmedWatchOnly;
+    nImmatureWatchOnly -= other.nImmatureWatchOnly;
+    nLocked -= other.nLocked;
+    nUnlocked -= other.nUnlocked;
+    nLockedWatchOnly -= other.nLockedWatchOnly;
+    nAnonymizable -= other.nAnonymizable;
+    nAnonymized -= other.nAnonymized;
+    nDenominatedConf -= other.nDenominatedConf;
+    nDenominatedUnconf -= other.nDenominatedUnconf;
+    return *this;
+}
 
-CAmount CWallet::GetUnlockedCoins() const
+bool operator==(const CWalletBalances& a, const CWalletBalances& b)
 {
-    if (fLiteMode) return 0;
+    return a.nBalance == b.nBalance && a.nUnconfirmed == b.nUnconfirmed && a.nImmature == b.nImmature &&
+           a.nWatchOnly == b.nWatchOnly && a.nUnconfirmedWatchOnly == b.nUnconfirmedWatchOnly && a.nImmatureWatchOnly == b.nImmatureWatchOnly &&
+           a.nLocked == b.nLocked && a.nUnlocked == b.nUnlocked && a.nLockedWatchOnly == b.nLockedWatchOnly &&
+           a.nAnonymizable == b.nAnonymizable && a.nAnonymized == b.nAnonymized &&
+           a.nDenominatedConf == b.nDenominatedConf && a.nDenominatedUnconf == b.nDenominatedUnconf;
+}
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+void CWallet::MarkBalancesDirty(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    setBalancesDirty.insert(tx.GetHash());
 
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetUnlockedCredit();
-        }
+    // Whether the outputs this tx spends count as spent depends on it
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mapWallet.count(txin.prevout.hash))
+            setBalancesDirty.insert(txin.prevout.hash);
     }
+}
 
-    return nTotal;
+/** The share of one wallet tx in each balance, as the balance getters used to sum it */
+CWalletBalances CWallet::GetTxBalances(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    CWalletBalances balances;
+    bool fTrusted = wtx.IsTrusted();
+    int nDepth = wtx.GetDepthInMainChain();
+
+    if (fTrusted) {
+        balances.nBalance = wtx.GetAvailableCredit();
+        balances.nWatchOnly = wtx.GetAvailableWatchOnlyCredit();
+    }
+    if (!IsFinalTx(wtx) || (!fTrusted && nDepth == 0)) {
+        balances.nUnconfirmed = wtx.GetAvailableCredit();
+        balances.nUnconfirmedWatchOnly = wtx.GetAvailableWatchOnlyCredit();
+    }
+    if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0 && nDepth > 0)
+        balances.nImmature = wtx.GetCredit(ISMINE_SPENDABLE) - wtx.GetDebit(ISMINE_SPENDABLE);
+    balances.nImmatureWatchOnly = wtx.GetImmatureWatchOnlyCredit();
+    if (fTrusted && nDepth > 0)
+        balances.nLockedWatchOnly = wtx.GetLockedWatchOnlyCredit();
+
+    if (!fLiteMode) {
+        if (fTrusted) {
+            balances.nAnonymizable = wtx.GetAnonymizableCredit();
+            balances.nAnonymized = wtx.GetAnonymizedCredit();
+        }
+        if (fTrusted && nDepth > 0) {
+            balances.nLocked = wtx.GetLockedCredit();
+            balances.nUnlocked = wtx.GetUnlockedCredit();
+        }
+        balances.nDenominatedConf = wtx.GetDenominatedCredit(false);
+        balances.nDenominatedUnconf = wtx.GetDenominatedCredit(true);
+    }
+    return balances;
 }
 
-CAmount CWallet::GetLockedCoins() const
+void CWallet::UpdateBalances() const
 {
-    if (fLiteMode) return 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+    // Start over after a reorg, as confirmed txs may have left the chain
+    if (pindexBalances != chainActive.Tip()) {
+        if (!pindexBalances || !chainActive.Tip() || chainActive.Tip()->GetAncestor(pindexBalances->nHeight) != pindexBalances)
+            fBalancesLoaded = false;
+        pindexBalances = chainActive.Tip();
+    }
+
+    if (!fBalancesLoaded) {
+        balancesTotal.SetNull();
+        mapTxBalances.clear();
+        setBalancesUnconfirmed.clear();
+        mapBalancesMaturity.clear();
+        BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
+            setBalancesDirty.insert(item.first);
+        fBalancesLoaded = true;
+    }
 
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedCredit();
+    while (!mapBalancesMaturity.empty() && mapBalancesMaturity.begin()->first <= chainActive.Height()) {
+        setBalancesDirty.insert(mapBalancesMaturity.begin()->second);
+        mapBalancesMaturity.erase(mapBalancesMaturity.begin());
+    }
+
+    // Unconfirmed txs can be trusted or not, drop out of the mempool or become
+    // final without the wallet being told, and so can the spent state of the
+    // outputs they spend
+    BOOST_FOREACH (const uint256& hash, setBalancesUnconfirmed) {
+        setBalancesDirty.insert(hash);
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, mi->second.vin) {
+            if (mapWallet.count(txin.prevout.hash))
+                setBalancesDirty.insert(txin.prevout.hash);
         }
     }
 
-    return nTotal;
+    BOOST_FOREACH (const uint256& hash, setBalancesDirty) {
+        map<uint256, CWalletBalances>::iterator bi = mapTxBalances.find(hash);
+        if (bi != mapTxBalances.end()) {
+            balancesTotal -= bi->second;
+            mapTxBalances.erase(bi);
+        }
+        setBalancesUnconfirmed.erase(hash);
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+
+        const CWalletTx& wtx = mi->second;
+        CWalletBalances balances = GetTxBalances(wtx);
+        if (!balances.IsNull()) {
+            mapTxBalances[hash] = balances;
+            balancesTotal += balances;
+        }
+
+        int nDepth = wtx.GetDepthInMainChain(false);
+        if (nDepth == 0 || !IsFinalTx(wtx))
+            setBalancesUnconfirmed.insert(hash);
+        else if (nDepth > 0 && wtx.GetBlocksToMaturity() > 0)
+            mapBalancesMaturity.insert(make_pair(chainActive.Height() + wtx.GetBlocksToMaturity(), hash));
+    }
+    setBalancesDirty.clear();
 }
 
-CAmount CWallet::GetAnonymizableBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    if (fLiteMode) return 0;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+
+    if (fCheckBalances) {
+        CWalletBalances balancesScan = GetBalancesFullScan();
+        if (balancesScan != balancesTotal) {
+            LogPrintf("%s : cached balances differ from a full scan (balance %s, expected %s), recomputing\n", __func__,
+                FormatMoney(balancesTotal.nBalance), FormatMoney(balancesScan.nBalance));
+            fBalancesLoaded = false;
+            UpdateBalances();
+        }
+    }
+    return balancesTotal;
+}
 
-    CAmount nTotal = 0;
+CWalletBalances CWallet::GetBalancesFullScan() const
+{
+    CWalletBalances balances;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizableCredit();
-        }
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            balances += GetTxBalances(it->second);
     }
+    return balances;
+}
 
-    return nTotal;
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
 }
 
-CAmount CWallet::GetAnonymizedBalance() const
+int nLastMaturityCheck = 0;
+
+CAmount CWallet::GetUnlockedCoins() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+    return GetBalances().nUnlocked;
+}
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
+CAmount CWallet::GetLockedCoins() const
+{
+    if (fLiteMode) return 0;
 
-    return nTotal;
+    return GetBalances().nLocked;
+}
+
+CAmount CWallet::GetAnonymizableBalance() const
+{
+    if (fLiteMode) return 0;
+
+    return GetBalances().nAnonymizable;
+}
+
+CAmount CWallet::GetAnonymizedBalance() const
+{
+    if (fLiteMode) return 0;
+
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1757,105 +2199,136 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    CWalletBalances balances = GetBalances();
+    return unconfirmed ? balances.nDenominatedUnconf : balances.nDenominatedConf;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0) {
-                  nTotal += pcoin->GetCredit(ISMINE_SPENDABLE) - pcoin->GetDebit(ISMINE_SPENDABLE);
-            }
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnly;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmedWatchOnly;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmatureWatchOnly;
 }
 
 CAmount CWallet::GetLockedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedWatchOnlyCredit();
+    return GetBalances().nLockedWatchOnly;
+}
+
+CWallet::WalletOutputType CWallet::GetWalletOutputType(CAmount nValue) const
+{
+    if (nValue == 150000 * COIN)
+        return OUTPUT_MASTERNODE;
+    if (IsDenominatedAmount(nValue))
+        return OUTPUT_DENOMINATED;
+    if (IsCollateralAmount(nValue))
+        return OUTPUT_COLLATERAL;
+    return OUTPUT_OTHER;
+}
+
+void CWallet::MarkWalletOutputsDirty(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    setWalletOutputsDirty.insert(tx.GetHash());
+
+    // The outputs this tx spends leave the index once it is confirmed
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mapWallet.count(txin.prevout.hash))
+            setWalletOutputsDirty.insert(txin.prevout.hash);
+    }
+}
+
+void CWallet::UpdateWalletOutputs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Start over after a reorg, as spending txs may have left the chain, and
+    // once the obfuscation denominations are known
+    if (pindexWalletOutputs != chainActive.Tip()) {
+        if (!pindexWalletOutputs || !chainActive.Tip() || chainActive.Tip()->GetAncestor(pindexWalletOutputs->nHeight) != pindexWalletOutputs)
+            fWalletOutputsLoaded = false;
+        pindexWalletOutputs = chainActive.Tip();
+    }
+    if (nWalletOutputsDenominations != obfuScationDenominations.size()) {
+        nWalletOutputsDenominations = obfuScationDenominations.size();
+        fWalletOutputsLoaded = false;
+    }
+
+    if (!fWalletOutputsLoaded) {
+        for (int nType = 0; nType < OUTPUT_TYPES; nType++)
+            mapWalletOutputs[nType].clear();
+        BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
+            setWalletOutputsDirty.insert(item.first);
+        fWalletOutputsLoaded = true;
+    }
+
+    BOOST_FOREACH (const uint256& hash, setWalletOutputsDirty) {
+        for (int nType = 0; nType < OUTPUT_TYPES; nType++) {
+            mapWalletOutputs[nType].erase(mapWalletOutputs[nType].lower_bound(COutPoint(hash, 0)),
+                                          mapWalletOutputs[nType].upper_bound(COutPoint(hash, std::numeric_limits<uint32_t>::max())));
+        }
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+
+        const CWalletTx& wtx = mi->second;
+        int nMaturityHeight = 0;
+        if (wtx.IsCoinBase() || wtx.IsCoinStake()) {
+            if (wtx.GetDepthInMainChain(false) > 0)
+                nMaturityHeight = chainActive.Height() + wtx.GetBlocksToMaturity();
+            else
+                nMaturityHeight = std::numeric_limits<int>::max();
+        }
+
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            if (IsMine(wtx.vout[i]) == ISMINE_NO)
+                continue;
+
+            bool fSpentConfirmed = false;
+            std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+            for (TxSpends::const_iterator it = range.first; it != range.second && !fSpentConfirmed; ++it) {
+                map<uint256, CWalletTx>::const_iterator si = mapWallet.find(it->second);
+                fSpentConfirmed = si != mapWallet.end() && si->second.GetDepthInMainChain(false) > 0;
+            }
+            if (fSpentConfirmed)
+                continue;
+
+            mapWalletOutputs[GetWalletOutputType(wtx.vout[i].nValue)][COutPoint(hash, i)] = nMaturityHeight;
         }
     }
-    return nTotal;
+    setWalletOutputsDirty.clear();
 }
 
+/** Orders outputs as a walk over mapWallet would */
+struct CompareOutputByOutPoint {
+    bool operator()(const COutput& a, const COutput& b) const
+    {
+        if (a.tx->GetHash() != b.tx->GetHash())
+            return a.tx->GetHash() < b.tx->GetHash();
+        return a.i < b.i;
+    }
+};
+
 /**
  * populate vCoins with vector of available COutputs.
  */
@@ -1865,45 +2338,51 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // Do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
-                continue;
+        UpdateWalletOutputs();
+
+        std::vector<int> vTypes;
+        if (nCoinType == ONLY_DENOMINATED) {
+            vTypes.push_back(OUTPUT_DENOMINATED);
+        } else if (nCoinType == ONLY_NOT10000IFMN) {
+            vTypes.push_back(OUTPUT_OTHER);
+            vTypes.push_back(OUTPUT_DENOMINATED);
+            vTypes.push_back(OUTPUT_COLLATERAL);
+            if (!fMasterNode) vTypes.push_back(OUTPUT_MASTERNODE);
+        } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
+            vTypes.push_back(OUTPUT_OTHER);
+            if (!fMasterNode) vTypes.push_back(OUTPUT_MASTERNODE); // do not use Hot MN funds
+        } else if (nCoinType == ONLY_10000) {
+            vTypes.push_back(OUTPUT_MASTERNODE);
+        } else {
+            for (int nType = 0; nType < OUTPUT_TYPES; nType++)
+                vTypes.push_back(nType);
+        }
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
+        BOOST_FOREACH (int nType, vTypes) {
+            const CWalletTx* pcoin = NULL;
+            bool fAvailableTx = false;
+            int nDepth = 0;
+            for (map<COutPoint, int>::const_iterator it = mapWalletOutputs[nType].begin(); it != mapWalletOutputs[nType].end(); ++it) {
+                // Still immature
+                if (it->second > chainActive.Height())
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOT10000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == 150000 * COIN);
-                } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = pcoin->vout[i].nValue != 150000 * COIN; // do not use Hot MN funds
-                } else if (nCoinType == ONLY_10000) {
-                    found = pcoin->vout[i].nValue == 150000 * COIN;
-                } else {
-                    found = true;
+                const uint256& wtxid = it->first.hash;
+                unsigned int i = it->first.n;
+                if (!pcoin || pcoin->GetHash() != wtxid) {
+                    pcoin = &mapWallet.find(wtxid)->second;
+                    nDepth = pcoin->GetDepthInMainChain(false);
+                    fAvailableTx = CheckFinalTx(*pcoin) &&
+                                   !(fOnlyConfirmed && !pcoin->IsTrusted()) &&
+                                   !((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0) &&
+                                   // Do not use IX for inputs that have less then 6 blockchain confirmations
+                                   !(fUseIX && nDepth < 6) &&
+                                   // We should not consider coins which aren't at least in our mempool
+                                   // It's possible for these to be conflicted via ancestors which we may never be able to detect
+                                   !(nDepth == 0 && !pcoin->InMempool());
                 }
-                if (!found) continue;
+                if (!fAvailableTx)
+                    continue;
 
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (IsSpent(wtxid, i))
@@ -1918,13 +2397,13 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
                 if (mine == ISMINE_WATCH_ONLY && nWatchonlyConfig == 1)
                     continue;
 
-                if (IsLockedCoin((*it).first, i) && nCoinType != ONLY_10000)
+                if (IsLockedCoin(wtxid, i) && nCoinType != ONLY_10000)
                     continue;
 
                 if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
                     continue;
 
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
+                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(wtxid, i))
                     continue;
 
                 bool fIsSpendable = false;
@@ -1937,6 +2416,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
                 vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
             }
         }
+
+        if (vTypes.size() > 1)
+            std::sort(vCoins.begin(), vCoins.end(), CompareOutputByOutPoint());
     }
 }
 
@@ -2017,39 +2499,239 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
-bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount)
+void CWallet::MarkStakeCandidatesDirty(const CTransaction& tx)
 {
-    LOCK(cs_main);
-    //Add MCH
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    AssertLockHeld(cs_wallet);
+    setStakeCandidatesDirty.insert(tx.GetHash());
+
+    // The outputs this tx spends may no longer be stakable
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mapWallet.count(txin.prevout.hash))
+            setStakeCandidatesDirty.insert(txin.prevout.hash);
+    }
+}
+
+void CWallet::UpdateStakeCandidates()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fStakeCandidatesLoaded) {
+        BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
+            setStakeCandidatesDirty.insert(item.first);
+        fStakeCandidatesLoaded = true;
+    }
+
+    // Blocks may have been disconnected since the last sweep: drop candidates
+    // whose origin block left the active chain and forget stale modifiers
+    if (pindexStakeCandidates != chainActive.Tip()) {
+        for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end();) {
+            CStakeCandidate& candidate = it->second;
+            if (!chainActive.Contains(candidate.pindexFrom)) {
+                setStakeCandidatesDirty.insert(it->first.hash);
+                mapStakeCandidates.erase(it++);
+                continue;
+            }
+            if (candidate.pindexModifier && !chainActive.Contains(candidate.pindexModifier))
+                candidate.pindexModifier = NULL;
+            ++it;
+        }
+        pindexStakeCandidates = chainActive.Tip();
+    }
+
+    BOOST_FOREACH (const uint256& hash, setStakeCandidatesDirty) {
+        mapStakeCandidates.erase(mapStakeCandidates.lower_bound(COutPoint(hash, 0)),
+                                 mapStakeCandidates.upper_bound(COutPoint(hash, std::numeric_limits<uint32_t>::max())));
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+
+        const CWalletTx& wtx = mi->second;
+        if (wtx.hashBlock == 0 || !CheckFinalTx(wtx))
+            continue;
+
+        BlockMap::const_iterator bi = mapBlockIndex.find(wtx.hashBlock);
+        if (bi == mapBlockIndex.end() || !chainActive.Contains(bi->second))
+            continue;
+
+        int nMinDepth = wtx.IsCoinStake() ? Params().COINBASE_MATURITY() : 10;
+        if (wtx.IsCoinBase() || wtx.IsCoinStake())
+            nMinDepth = std::max(nMinDepth, Params().COINBASE_MATURITY() + 1);
+
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            if (wtx.vout[i].nValue <= 0)
+                continue;
+
+            isminetype mine = IsMine(wtx.vout[i]);
+            if (mine == ISMINE_NO || mine == ISMINE_WATCH_ONLY)
+                continue;
+
+            if (IsSpent(hash, i))
+                continue;
+
+            CStakeCandidate& candidate = mapStakeCandidates[COutPoint(hash, i)];
+            candidate.outpoint = COutPoint(hash, i);
+            candidate.nValue = wtx.vout[i].nValue;
+            candidate.nTxTime = wtx.GetTxTime();
+            candidate.nMinDepth = nMinDepth;
+            candidate.pindexFrom = bi->second;
+        }
+    }
+    setStakeCandidatesDirty.clear();
+}
+
+bool CWallet::SelectStakeCandidates(std::vector<CStakeCandidate>& vCandidates, CAmount nTargetAmount)
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateStakeCandidates();
+
     CAmount nAmountSelected = 0;
     if (GetBoolArg("-mktcashstake", true)) {
-        for (const COutput &out : vCoins) {
+        int nHeight = chainActive.Height();
+        int64_t nAdjustedTime = GetAdjustedTime();
+        for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); ++it) {
+            CStakeCandidate& candidate = it->second;
+
             //make sure not to outrun target amount
-            if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+            if (nAmountSelected + candidate.nValue > nTargetAmount)
                 continue;
 
-            // Get tx time
-            int64_t nTxTime = out.tx->GetTxTime();
-
             // Check for min age
-            if (GetAdjustedTime() - nTxTime < nStakeMinAge)
+            if (nAdjustedTime - candidate.nTxTime < nStakeMinAge)
                 continue;
 
             // Check that it is matured
-            if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+            if (nHeight - candidate.pindexFrom->nHeight + 1 < candidate.nMinDepth)
                 continue;
 
+            if (IsSpent(candidate.outpoint.hash, candidate.outpoint.n) || IsLockedCoin(candidate.outpoint.hash, candidate.outpoint.n))
+                continue;
+
+            // Resolve the kernel stake modifier once and keep the hash preimage around
+            if (!candidate.pindexModifier) {
+                uint64_t nStakeModifier = 0;
+                int nStakeModifierHeight = 0;
+                int64_t nStakeModifierTime = 0;
+                if (!GetKernelStakeModifier(candidate.pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime))
+                    continue;
+
+                CDataStream ssUniqueID(SER_NETWORK, 0);
+                ssUniqueID << candidate.outpoint.n << candidate.outpoint.hash;
+                candidate.preimage = CStakeKernelPreimage(nStakeModifier, candidate.pindexFrom->nTime, ssUniqueID);
+                candidate.pindexModifier = chainActive[nStakeModifierHeight];
+            }
+
             // Add to our stake set
-            nAmountSelected += out.tx->vout[out.i].nValue;
+            nAmountSelected += candidate.nValue;
+            vCandidates.push_back(candidate);
+        }
+    }
+
+    return true;
+}
 
-            std::unique_ptr<CMCHStake> input(new CMCHStake());
-            input->SetInput((CTransaction) *out.tx, out.i);
-            listInputs.emplace_back(std::move(input));
+/** Shared state of one multi-threaded kernel search */
+struct CStakeSearch {
+    std::vector<CStakeCandidate>& vCandidates;
+    uint256 bnTargetPerCoinDay;
+    unsigned int nTimeTx;
+    const std::atomic<unsigned int>& nTipUpdates;
+    unsigned int nTipUpdatesStart;
+
+    std::atomic<size_t> nNext;
+    std::atomic<bool> fStop;
+
+    boost::mutex cs;
+    size_t nFound;
+    unsigned int nTimeFound;
+    uint256 hashProofOfStake;
+
+    CStakeSearch(std::vector<CStakeCandidate>& vCandidatesIn, size_t nStart, const std::atomic<unsigned int>& nTipUpdatesIn)
+        : vCandidates(vCandidatesIn), nTimeTx(0), nTipUpdates(nTipUpdatesIn), nTipUpdatesStart(nTipUpdatesIn),
+          nNext(nStart), fStop(false), nFound(vCandidatesIn.size()), nTimeFound(0) {}
+};
+
+static void ThreadStakeSearch(CStakeSearch* search)
+{
+    while (!search->fStop) {
+        // A new tip invalidates the snapshot, leave it to the next miner round
+        if (search->nTipUpdates != search->nTipUpdatesStart || ShutdownRequested()) {
+            search->fStop = true;
+            break;
+        }
+
+        size_t i = search->nNext++;
+        if (i >= search->vCandidates.size())
+            break;
+
+        CStakeCandidate& candidate = search->vCandidates[i];
+        unsigned int nTimeTx = search->nTimeTx;
+        uint256 hashProofOfStake;
+        if (!StakeHashDrift(candidate.preimage, candidate.nValue, search->bnTargetPerCoinDay, candidate.pindexFrom->nTime, nTimeTx, hashProofOfStake))
+            continue;
+
+        // Keep the lowest hit so the result matches a sequential sweep
+        boost::lock_guard<boost::mutex> lock(search->cs);
+        if (i < search->nFound) {
+            search->nFound = i;
+            search->nTimeFound = nTimeTx;
+            search->hashProofOfStake = hashProofOfStake;
         }
+        search->fStop = true;
     }
+}
+
+/**
+ * Find the first candidate at or after nStart whose kernel meets the target.
+ * With -stakethreads > 1 the candidates are hashed by a pool of worker threads
+ * against the snapshot taken by SelectStakeCandidates.
+ */
+bool CWallet::SearchStakeKernel(std::vector<CStakeCandidate>& vCandidates, size_t nStart, unsigned int nBits, unsigned int& nTxNewTime, uint256& hashProofOfStake, size_t& nFound)
+{
+    int nThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_STAKE_THREADS));
+
+    if (nThreads == 1) {
+        for (size_t i = nStart; i < vCandidates.size(); i++) {
+            // Make sure the wallet is unlocked and shutdown hasn't been requested
+            if (IsLocked() || ShutdownRequested())
+                return false;
+
+            CStakeCandidate& candidate = vCandidates[i];
+            nTxNewTime = GetAdjustedTime();
+            if (Stake(candidate.preimage, candidate.nValue, nBits, candidate.pindexFrom->nTime, nTxNewTime, hashProofOfStake)) {
+                nFound = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (IsLocked() || ShutdownRequested() || nStart >= vCandidates.size())
+        return false;
+
+    CStakeSearch search(vCandidates, nStart, nTipUpdates);
+    search.bnTargetPerCoinDay.SetCompact(nBits);
+    search.nTimeTx = GetAdjustedTime();
+
+    int nHeightStart = chainActive.Height();
+    boost::thread_group threads;
+    for (int i = 0; i < std::min(nThreads, (int)(vCandidates.size() - nStart)); i++)
+        threads.create_thread(boost::bind(&ThreadStakeSearch, &search));
+    threads.join_all();
+
+    mapHashedBlocks.clear();
+    mapHashedBlocks[nHeightStart] = GetTime(); // Store a time stamp of when we last hashed on this block
+
+    if (search.nFound == vCandidates.size())
+        return false;
 
+    nFound = search.nFound;
+    nTxNewTime = search.nTimeFound;
+    hashProofOfStake = search.hashProofOfStake;
     return true;
 }
 
@@ -2796,11 +3478,11 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         return false;
 
     // Get the list of stakable inputs
-    std::list<std::unique_ptr<CStakeInput> > listInputs;
-    if (!SelectStakeCoins(listInputs, nBalance - nReserveBalance))
+    std::vector<CStakeCandidate> vCandidates;
+    if (!SelectStakeCandidates(vCandidates, nBalance - nReserveBalance))
         return false;
 
-    if (listInputs.empty())
+    if (vCandidates.empty())
         return false;
 
     if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
@@ -2809,83 +3491,76 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CAmount nCredit;
     CScript scriptPubKeyKernel;
     bool fKernelFound = false;
-    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+    size_t nFound = 0;
+    for (size_t nNext = 0; nNext < vCandidates.size(); nNext = nFound + 1) {
         nCredit = 0;
-        // Make sure the wallet is unlocked and shutdown hasn't been requested
-        if (IsLocked() || ShutdownRequested())
-            return false;
-
-        // Make sure that enough time has elapsed between
-        CBlockIndex* pindex = stakeInput->GetIndexFrom();
-        if (!pindex || pindex->nHeight < 1) {
-            LogPrintf("*** no pindexfrom\n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
         uint256 hashProofOfStake = 0;
-        nTxNewTime = GetAdjustedTime();
 
         // Iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
-            LOCK(cs_main);
-            // Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
-
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
+        if (!SearchStakeKernel(vCandidates, nNext, nBits, nTxNewTime, hashProofOfStake, nFound))
+            break;
 
-            // Calculate reward
-            CAmount nReward;
-            nReward = GetBlockValue(chainActive.Height() + 1);
-            nCredit += nReward;
+        CStakeCandidate& candidate = vCandidates[nFound];
+        LOCK2(cs_main, cs_wallet);
+        // Double check that this will pass time requirements
+        if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+            LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+            continue;
+        }
 
-            // Create the output transaction(s)
-            vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+        const CWalletTx* wtxFrom = GetWalletTx(candidate.outpoint.hash);
+        if (!wtxFrom)
+            continue;
 
-            CAmount nMinFee = 0;
+        std::unique_ptr<CMCHStake> stakeInput(new CMCHStake());
+        stakeInput->SetInput((CTransaction)*wtxFrom, candidate.outpoint.n);
 
-            // Set output amount
-            if (txNew.vout.size() == 3) {
-                txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
-                txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
-            } else
-                txNew.vout[1].nValue = nCredit - nMinFee;
+        // Found a kernel
+        LogPrintf("CreateCoinStake : kernel found\n");
+        nCredit += stakeInput->GetValue();
 
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
+        // Calculate reward
+        CAmount nReward;
+        nReward = GetBlockValue(chainActive.Height() + 1);
+        nCredit += nReward;
 
-            // Masternode payment
-            FillBlockPayee(txNew, nMinFee, true);
+        // Create the output transaction(s)
+        vector<CTxOut> vout;
+        if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
+            LogPrintf("%s : failed to get scriptPubKey\n", __func__);
+            continue;
+        }
+        txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
 
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                continue;
-            }
-            txNew.vin.emplace_back(in);
+        CAmount nMinFee = 0;
 
-            fKernelFound = true;
-            break;
+        // Set output amount
+        if (txNew.vout.size() == 3) {
+            txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
+            txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
+        } else
+            txNew.vout[1].nValue = nCredit - nMinFee;
+
+        // Limit size
+        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+            return error("CreateCoinStake : exceeded coinstake size limit");
+
+        // Masternode payment
+        FillBlockPayee(txNew, nMinFee, true);
+
+        uint256 hashTxOut = txNew.GetHash();
+        CTxIn in;
+        if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
+            LogPrintf("%s : failed to create TxIn\n", __func__);
+            txNew.vin.clear();
+            txNew.vout.clear();
+            continue;
         }
+        txNew.vin.emplace_back(in);
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        fKernelFound = true;
+        break;
     }
 
     if (!fKernelFound)
@@ -3595,17 +4270,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    setBalancesDirty.insert(output.hash);
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    setBalancesDirty.insert(output.hash);
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
+    BOOST_FOREACH (const COutPoint& outpoint, setLockedCoins)
+        setBalancesDirty.insert(outpoint.hash);
     setLockedCoins.clear();
 }
 
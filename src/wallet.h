@@ -25,6 +25,7 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -42,6 +43,7 @@ extern unsigned int nTxConfirmTarget;
 extern bool bdisableSystemnotifications;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern bool fCheckBalances;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -55,12 +57,19 @@ static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWa
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //! -custombackupthreshold default
 static const int DEFAULT_CUSTOMBACKUPTHRESHOLD = 1;
+//! -stakethreads default, 1 keeps the kernel search on the miner thread
+static const int DEFAULT_STAKE_THREADS = 1;
+//! Maximum number of kernel search threads
+static const int MAX_STAKE_THREADS = 16;
+//! Maximum number of threads reading and matching blocks ahead of a wallet rescan
+static const int MAX_RESCAN_THREADS = 8;
 
 class CAccountingEntry;
 class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWalletRescanReserver;
 class CWalletTx;
 
 /** (client) version numbers for particular wallet features */
@@ -92,6 +101,47 @@ struct CompactTallyItem {
     }
 };
 
+/** A stakable wallet output together with its cached kernel inputs */
+struct CStakeCandidate {
+    COutPoint outpoint;
+    CAmount nValue;
+    int64_t nTxTime;
+    int nMinDepth;
+    //! Block the output was confirmed in
+    const CBlockIndex* pindexFrom;
+    //! Block providing the kernel stake modifier, NULL until the chain has advanced far enough
+    const CBlockIndex* pindexModifier;
+    CStakeKernelPreimage preimage;
+
+    CStakeCandidate() : nValue(0), nTxTime(0), nMinDepth(0), pindexFrom(NULL), pindexModifier(NULL) {}
+};
+
+/** Wallet balances, either in total or the share of one wallet tx */
+struct CWalletBalances {
+    CAmount nBalance;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnly;
+    CAmount nUnconfirmedWatchOnly;
+    CAmount nImmatureWatchOnly;
+    CAmount nLocked;
+    CAmount nUnlocked;
+    CAmount nLockedWatchOnly;
+    CAmount nAnonymizable;
+    CAmount nAnonymized;
+    CAmount nDenominatedConf;
+    CAmount nDenominatedUnconf;
+
+    CWalletBalances() { SetNull(); }
+
+    void SetNull();
+    bool IsNull() const;
+    CWalletBalances& operator+=(const CWalletBalances& other);
+    CWalletBalances& operator-=(const CWalletBalances& other);
+    friend bool operator==(const CWalletBalances& a, const CWalletBalances& b);
+    friend bool operator!=(const CWalletBalances& a, const CWalletBalances& b) { return !(a == b); }
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -163,9 +213,74 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Stakable outputs keyed by outpoint. Entries are rebuilt per txid when a
+     * wallet tx changes and revalidated when the chain tip moves, so a kernel
+     * sweep does not have to walk mapWallet.
+     */
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    std::set<uint256> setStakeCandidatesDirty;
+    const CBlockIndex* pindexStakeCandidates;
+    bool fStakeCandidatesLoaded;
+    void MarkStakeCandidatesDirty(const CTransaction& tx);
+    void UpdateStakeCandidates();
+
+    /**
+     * Balance totals kept per wallet tx, so that the balance getters do not
+     * have to walk mapWallet. The share of a tx is recomputed when it or a tx
+     * spending it changes, when one of its coins is locked or unlocked, when it
+     * reaches maturity, and on every query while it is unconfirmed. A reorg
+     * recomputes every tx. Only txs with a non-zero share are kept.
+     */
+    mutable CWalletBalances balancesTotal;
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalancesDirty;
+    mutable std::set<uint256> setBalancesUnconfirmed;
+    //! Generated txs to recompute once the chain reaches the given height
+    mutable std::multimap<int, uint256> mapBalancesMaturity;
+    mutable const CBlockIndex* pindexBalances;
+    mutable bool fBalancesLoaded;
+    void MarkBalancesDirty(const CTransaction& tx);
+    CWalletBalances GetTxBalances(const CWalletTx& wtx) const;
+    void UpdateBalances() const;
+
+    /**
+     * Outputs that are mine and not spent by a confirmed wallet tx, bucketed by
+     * coin type and mapped to the chain height at which they are mature.
+     * AvailableCoins only walks the buckets of the requested coin type and
+     * checks the remaining conditions on those outputs alone. Entries are
+     * rebuilt per txid like the stake candidates, and all of them after a
+     * reorg.
+     */
+    enum WalletOutputType {
+        OUTPUT_OTHER,
+        OUTPUT_DENOMINATED,
+        OUTPUT_COLLATERAL,
+        OUTPUT_MASTERNODE,
+        OUTPUT_TYPES
+    };
+    mutable std::map<COutPoint, int> mapWalletOutputs[OUTPUT_TYPES];
+    mutable std::set<uint256> setWalletOutputsDirty;
+    mutable const CBlockIndex* pindexWalletOutputs;
+    mutable size_t nWalletOutputsDenominations;
+    mutable bool fWalletOutputsLoaded;
+    WalletOutputType GetWalletOutputType(CAmount nValue) const;
+    void MarkWalletOutputsDirty(const CTransaction& tx);
+    void UpdateWalletOutputs() const;
+
+    //! Rescan state, reported by getwalletinfo and cancelled with abortrescan
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+    std::atomic<int64_t> nScanStartTime;
+    std::atomic<double> dScanProgress;
+
+    //! Bumped on every new chain tip so kernel search threads can stop without taking cs_main
+    std::atomic<unsigned int> nTipUpdates;
+    bool SearchStakeKernel(std::vector<CStakeCandidate>& vCandidates, size_t nStart, unsigned int nBits, unsigned int& nTxNewTime, uint256& hashProofOfStake, size_t& nFound);
+
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
+    bool SelectStakeCandidates(std::vector<CStakeCandidate>& vCandidates, CAmount nTargetAmount);
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -247,6 +362,18 @@ public:
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
         fBackupMints = false;
+        pindexStakeCandidates = NULL;
+        fStakeCandidatesLoaded = false;
+        pindexBalances = NULL;
+        fBalancesLoaded = false;
+        pindexWalletOutputs = NULL;
+        nWalletOutputsDenominations = 0;
+        fWalletOutputsLoaded = false;
+        nTipUpdates = 0;
+        fAbortRescan = false;
+        fScanningWallet = false;
+        nScanStartTime = 0;
+        dScanProgress = 0;
 
         // Stake Settings
         nHashDrift = 45;
@@ -387,11 +514,23 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void UpdatedBlockTip(const CBlockIndex* pindex);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! Claim the wallet's single rescan slot; false if another rescan holds it
+    bool ReserveRescan();
+    void ReleaseRescan() { fScanningWallet = false; }
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate = false);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
+    bool IsScanning() const { return fScanningWallet; }
+    int64_t ScanningDuration() const { return fScanningWallet ? GetTimeMillis() - nScanStartTime : 0; }
+    double ScanningProgress() const { return fScanningWallet ? (double)dScanProgress : 0; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    //! All balances at once, from the per-tx totals or with a full scan of mapWallet
+    CWalletBalances GetBalances() const;
+    CWalletBalances GetBalancesFullScan() const;
     CAmount GetBalance() const;
     CAmount GetLockedCoins() const;
     CAmount GetUnlockedCoins() const;
@@ -587,6 +726,33 @@ public:
     boost::signals2::signal<void (const bool& fSuccess, const std::string& filename)> NotifyWalletBacked;
 };
 
+/**
+ * Holds the wallet's rescan slot while alive. Reserve it before adding the
+ * keys or scripts to scan for, so that no other rescan can start in between
+ * and IsAbortingRescan() refers to this rescan.
+ */
+class CWalletRescanReserver
+{
+private:
+    CWallet* pwallet;
+    bool fReserved;
+
+public:
+    CWalletRescanReserver(CWallet* pwalletIn) : pwallet(pwalletIn), fReserved(false) {}
+    ~CWalletRescanReserver()
+    {
+        if (fReserved)
+            pwallet->ReleaseRescan();
+    }
+
+    bool Reserve()
+    {
+        fReserved = pwallet->ReserveRescan();
+        return fReserved;
+    }
+    bool IsReserved() const { return fReserved; }
+};
+
 
 /** A key allocated from the key pool. */
 class CReserveKey